@@ -1,37 +1,121 @@
 #include <algorithm>
+#include <array>
+#include <atomic>
+#include <bit>
 #include <cassert>
 #include <chrono>
 #include <cmath>
+#include <condition_variable>
+#include <cstdint>
 #include <cstdlib>
 #include <cstring>
+#include <functional>
 #include <iomanip>
 #include <iostream>
+#include <limits>
 #include <memory>
+#include <mutex>
+#include <numeric>
 #include <numbers>
 #include <string>
+#include <system_error>
 #include <thread>
 #include <vector>
 
+void* png_thread_start(void (*func)(void*), void* arg);
+void png_thread_join(void* handle);
+unsigned int png_thread_wait(unsigned int* value, unsigned int old);
+void png_thread_store(unsigned int* value, unsigned int update);
+#define STBI_MMAP
+#define STBI_FAST_ZLIB
+#define STBI_THREAD_START(func, arg) png_thread_start(func, arg)
+#define STBI_THREAD_JOIN(handle) png_thread_join(handle)
+#define STBI_THREAD_WAIT(value, old) png_thread_wait(value, old)
+#define STBI_THREAD_STORE(value, update) png_thread_store(value, update)
 #define STB_IMAGE_IMPLEMENTATION
 #include "stb_image.h"
 
+void png_parallel_for(int count, void (*task)(void*, int), void* context);
+unsigned int png_crc32(unsigned char* buffer, int size);
+unsigned int png_adler32(unsigned char* data, int size);
+#define STBIW_PARALLEL_FOR(count, task, context) png_parallel_for(count, task, context)
+#define STBIW_CRC32(buffer, size) png_crc32(buffer, size)
+#define STBIW_ADLER32(data, size) png_adler32(data, size)
 #define STB_IMAGE_WRITE_IMPLEMENTATION
 #include "stb_image_write.h"
 
-#define BIT_DEPTH 8
+#if defined(__x86_64__) || defined(_M_X64)
+#define HAS_SSE2
+#include <immintrin.h>
+#endif
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#define TARGET_AVX2
+#define TARGET_SSSE3
+#define TARGET_CLMUL
+#else
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#define TARGET_SSSE3 __attribute__((target("ssse3")))
+#define TARGET_CLMUL __attribute__((target("pclmul,sse4.1")))
+#endif
 
 constexpr int GreyChannel = 1;
 constexpr float Ratio = 0.33f; // % of black pixels.
+const std::vector<float> Ratios = { 0.1f, 0.2f, 0.33f, 0.5f, 0.67f, 0.8f, 0.9f };
 constexpr std::string_view Padding = "    ";
 constexpr unsigned int SampleRate = 10;
+constexpr unsigned int Tolerance = 2; // 8-bit grey levels either side of the threshold.
+constexpr float Confidence = 0.99f;
+constexpr size_t MinSamples = 1024;
+constexpr unsigned int CellSize = 8; // One sample per 8x8 cell.
+constexpr uint64_t Seed = 0x5EED;
+constexpr size_t CacheLine = 64;
+constexpr size_t SubHistograms = 8;
+constexpr size_t SubHistogramBlock = (size_t)1 << 30; // Keeps 32-bit sub-bins from overflowing.
+constexpr size_t PrefetchDistance = 8; // Blocks ahead.
+constexpr uint32_t Crc32Polynomial = 0xEDB88320; // Reflected.
+constexpr uint32_t AdlerModulus = 65521;
+constexpr size_t AdlerBlock = 5552; // Most bytes before the sums can overflow.
 
 using namespace std::chrono_literals;
 
-#if BIT_DEPTH <= 8
-typedef stbi_uc Pixel;
-#else
-typedef stbi_uint16 Pixel;
-#endif
+/**
+ * Compile time properties of each supported pixel type. Every threshold
+ * function is a template over the pixel type, and picks its bin counts and
+ * masks from here.
+ */
+template <typename Pixel>
+struct PixelTraits;
+
+template <>
+struct PixelTraits<stbi_uc> {
+	static constexpr int BitDepth = 8;
+	static constexpr size_t Bins = (size_t)1 << BitDepth;
+	static constexpr stbi_uc Max = 0xFF;
+};
+
+template <>
+struct PixelTraits<stbi_us> {
+	static constexpr int BitDepth = 16;
+	static constexpr size_t Bins = (size_t)1 << BitDepth;
+	static constexpr stbi_us Max = 0xFFFF;
+	static constexpr int RadixShift = 8; // Radix select splits on the high byte.
+	static constexpr stbi_us RadixMask = 0xFF;
+};
+
+/**
+ * The threshold value found by a sampling method, along with how much of the
+ * image it had to read.
+ */
+template <typename Pixel>
+struct SampleResult {
+	Pixel threshold;
+	size_t pixels_read;
+	size_t bytes_touched; // Whole cache lines loaded from the image.
+	bool exact; // True if every pixel ended up being counted.
+};
+
 
 /**
  * Pretty print the threshold value and the time elapsed.
@@ -39,183 +123,1693 @@ typedef stbi_uint16 Pixel;
  * @param threshold - The threshold value found.
  * @param duration - The length of time the algorithm took (in seconds).
  */
-void display(const std::string& name, Pixel threshold, float duration) {
-	std::cout << name << std::endl;
-	std::cout << Padding << "Threshold: " << (int)threshold << std::endl;
-	std::cout << Padding << "Execution Time: " << std::fixed << std::setprecision(3) << duration << 's' << std::endl;
+template <typename Pixel>
+void display(const std::string& name, Pixel threshold, float duration) {
+	std::cout << name << std::endl;
+	std::cout << Padding << "Threshold: " << (int)threshold << std::endl;
+	std::cout << Padding << "Execution Time: " << std::fixed << std::setprecision(3) << duration << 's' << std::endl;
+}
+
+
+/**
+ * Pretty print the threshold value, the time elapsed and how much of the
+ * image a sampling method read.
+ * @param name - A reference name to use in the display output.
+ * @param result - The result of the sampling method.
+ * @param image_size - The number of pixels in the image.
+ * @param duration - The length of time the algorithm took (in seconds).
+ */
+template <typename Pixel>
+void display(const std::string& name, const SampleResult<Pixel>& result, size_t image_size, float duration) {
+	display(name, result.threshold, duration);
+	std::cout << Padding << "Pixels Read: " << result.pixels_read << " ("
+		<< std::setprecision(1) << 100.0f * result.pixels_read / image_size << "%)"
+		<< (result.exact ? ", exact" : "") << std::endl;
+	std::cout << Padding << "Bytes Touched: " << result.bytes_touched << " ("
+		<< 100.0f * result.bytes_touched / (image_size * sizeof(Pixel)) << "%)" << std::endl;
+}
+
+
+/**
+ * A fixed set of worker threads, started on first use and shared by every
+ * parallel_for, so each pass over the image does not pay for creating and
+ * joining threads again. The calling thread works alongside the workers.
+ */
+class ThreadPool {
+public:
+	/**
+	 * The pool shared by the whole program, with one worker per extra core.
+	 */
+	static ThreadPool& instance() {
+		static ThreadPool pool(std::max(1u, std::thread::hardware_concurrency()) - 1);
+		return pool;
+	}
+
+	/**
+	 * Run task once for each index in [0, count), spread across the workers
+	 * and the calling thread. Blocks until every index is done. A call made
+	 * from inside a task, or while another call is running, runs on the
+	 * calling thread alone rather than waiting on workers that are busy.
+	 * @param count - the number of indices.
+	 * @param task - called as task(index).
+	 */
+	void run(unsigned int count, const std::function<void(unsigned int)>& task) {
+		std::unique_lock<std::mutex> caller(run_mutex, std::try_to_lock);
+		if (count < 2 || workers.empty() || in_task || !caller.owns_lock()) {
+			for (unsigned int index = 0; index < count; index++) {
+				task(index);
+			}
+			return;
+		}
+
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			current = &task;
+			total = count;
+			next = 0;
+			active = (unsigned int)workers.size();
+			generation++;
+		}
+		wake.notify_all();
+		work();
+
+		std::unique_lock<std::mutex> lock(mutex);
+		done.wait(lock, [&] { return active == 0; });
+		current = nullptr;
+	}
+
+	~ThreadPool() {
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			stopping = true;
+		}
+		wake.notify_all();
+		for (std::thread& worker : workers) {
+			worker.join();
+		}
+	}
+
+private:
+	/**
+	 * @param size - the number of workers to start. Fewer are started if the
+	 * system refuses to create more threads.
+	 */
+	explicit ThreadPool(unsigned int size) {
+		for (unsigned int index = 0; index < size; index++) {
+			try {
+				workers.emplace_back([this] { loop(); });
+			} catch (const std::system_error&) {
+				break;
+			}
+		}
+	}
+
+	/**
+	 * Take indices from the current run until none are left.
+	 */
+	void work() {
+		in_task = true;
+		for (unsigned int index = next++; index < total; index = next++) {
+			(*current)(index);
+		}
+		in_task = false;
+	}
+
+	/**
+	 * A worker's life: wait for a run, help with it, report back.
+	 */
+	void loop() {
+		uint64_t seen = 0;
+		std::unique_lock<std::mutex> lock(mutex);
+		while (true) {
+			wake.wait(lock, [&] { return stopping || generation != seen; });
+			if (stopping) return;
+			seen = generation;
+
+			lock.unlock();
+			work();
+			lock.lock();
+			if (--active == 0) {
+				done.notify_one();
+			}
+		}
+	}
+
+	std::vector<std::thread> workers;
+	std::mutex run_mutex; // Held by the caller for the length of a run.
+	std::mutex mutex;
+	std::condition_variable wake;
+	std::condition_variable done;
+	const std::function<void(unsigned int)>* current = nullptr;
+	unsigned int total = 0;
+	std::atomic<unsigned int> next = 0;
+	unsigned int active = 0; // Workers yet to finish the current run.
+	uint64_t generation = 0;
+	bool stopping = false;
+	static thread_local bool in_task;
+};
+
+thread_local bool ThreadPool::in_task = false;
+
+
+/**
+ * Split the range [0, size) into one contiguous chunk per thread and run the
+ * given function on each chunk in parallel on the shared thread pool. Blocks
+ * until all chunks are done.
+ * @param size - the size of the range to split.
+ * @param threads - the number of chunks to split the range into.
+ * @param func - called as func(thread, begin, end) for each chunk, where
+ * 		thread is the chunk's index.
+ */
+template <typename Func>
+void parallel_for(size_t size, unsigned int threads, Func func) {
+	size_t chunk = (size + threads - 1) / threads;
+	ThreadPool::instance().run(threads, [&](unsigned int thread) {
+		size_t begin = std::min(size, thread * chunk);
+		size_t end = std::min(size, begin + chunk);
+		func(thread, begin, end);
+	});
+}
+
+
+/**
+ * Runs the PNG writer's tasks (deflate chunks, checksum pieces) on every core.
+ * @param count - the number of tasks.
+ * @param task - called once with each index in [0, count).
+ * @param context - passed through to each task.
+ */
+void png_parallel_for(int count, void (*task)(void*, int), void* context) {
+	unsigned int threads = std::min(std::max(1u, std::thread::hardware_concurrency()), (unsigned int)count);
+	parallel_for(count, threads, [&](unsigned int, size_t begin, size_t end) {
+		for (size_t i = begin; i < end; i++) {
+			task(context, (int)i);
+		}
+	});
+}
+
+
+/**
+ * Starts the PNG decoder's second thread, which unfilters rows while the first inflates.
+ * @param func - the thread's work.
+ * @param arg - passed to func.
+ * @return the thread, or nullptr to decode on one thread when there is only one
+ * core or the thread could not be created.
+ */
+void* png_thread_start(void (*func)(void*), void* arg) {
+	if (std::thread::hardware_concurrency() < 2) {
+		return nullptr;
+	}
+	// Exceptions must not unwind through the decoder, which would leak its buffers.
+	try {
+		return new std::thread(func, arg);
+	} catch (const std::system_error&) {
+		return nullptr;
+	} catch (const std::bad_alloc&) {
+		return nullptr;
+	}
+}
+
+
+/**
+ * Waits for a thread from png_thread_start to finish.
+ * @param handle - the thread.
+ */
+void png_thread_join(void* handle) {
+	std::thread* thread = static_cast<std::thread*>(handle);
+	thread->join();
+	delete thread;
+}
+
+
+/**
+ * Blocks until a counter shared by the decoder's threads moves on.
+ * @param value - the counter.
+ * @param old - the value last seen.
+ * @return the new value.
+ */
+unsigned int png_thread_wait(unsigned int* value, unsigned int old) {
+	std::atomic_ref<unsigned int> counter(*value);
+	counter.wait(old, std::memory_order_acquire);
+	return counter.load(std::memory_order_acquire);
+}
+
+
+/**
+ * Updates a counter shared by the decoder's threads and wakes the other thread.
+ * @param value - the counter.
+ * @param update - the new value.
+ */
+void png_thread_store(unsigned int* value, unsigned int update) {
+	std::atomic_ref<unsigned int> counter(*value);
+	counter.store(update, std::memory_order_release);
+	counter.notify_all();
+}
+
+
+/**
+ * Walk the cumulative histogram to find the first value at which the number of
+ * pixels counted reaches the cutoff.
+ * @param count - the histogram, one bin per pixel value.
+ * @param cutoff - the number of pixels that should fall below the threshold.
+ */
+template <typename Pixel>
+Pixel find_threshold(const size_t* count, size_t cutoff) {
+	size_t total = 0;
+	size_t index = 0;
+
+	while (total < cutoff && index < PixelTraits<Pixel>::Bins) {
+		total += count[index++];
+	}
+	return std::max((size_t)0, index - 1);
+}
+
+
+/**
+ * Check at runtime whether the processor supports AVX2.
+ */
+bool cpu_has_avx2() {
+#if !defined(HAS_SSE2)
+	return false;
+#elif defined(_MSC_VER)
+	int info[4];
+	__cpuid(info, 0);
+	if (info[0] < 7) return false;
+	__cpuid(info, 1);
+	bool os_saves_ymm = (info[2] & (1 << 27)) && (_xgetbv(0) & 6) == 6;
+	__cpuidex(info, 7, 0);
+	return os_saves_ymm && (info[1] & (1 << 5));
+#else
+	return __builtin_cpu_supports("avx2");
+#endif
+}
+
+
+/**
+ * Check at runtime whether the processor supports SSSE3.
+ */
+bool cpu_has_ssse3() {
+#if !defined(HAS_SSE2)
+	return false;
+#elif defined(_MSC_VER)
+	int info[4];
+	__cpuid(info, 1);
+	return info[2] & (1 << 9);
+#else
+	return __builtin_cpu_supports("ssse3");
+#endif
+}
+
+
+/**
+ * Check at runtime whether the processor supports carry-less multiplication
+ * (PCLMULQDQ), along with the SSE4.1 the CRC kernel also uses.
+ */
+bool cpu_has_clmul() {
+#if !defined(HAS_SSE2)
+	return false;
+#elif defined(_MSC_VER)
+	int info[4];
+	__cpuid(info, 1);
+	return (info[2] & (1 << 1)) && (info[2] & (1 << 19));
+#else
+	return __builtin_cpu_supports("pclmul") && __builtin_cpu_supports("sse4.1");
+#endif
+}
+
+
+/**
+ * Slicing-by-8 CRC-32 tables. Table k holds the CRC of a byte followed by k
+ * zero bytes, so eight bytes are folded in with eight independent lookups.
+ */
+constexpr std::array<std::array<uint32_t, 256>, 8> Crc32Tables = [] {
+	std::array<std::array<uint32_t, 256>, 8> tables{};
+	for (uint32_t byte = 0; byte < 256; byte++) {
+		uint32_t crc = byte;
+		for (int bit = 0; bit < 8; bit++) {
+			crc = crc & 1 ? (crc >> 1) ^ Crc32Polynomial : crc >> 1;
+		}
+		tables[0][byte] = crc;
+	}
+	for (size_t table = 1; table < 8; table++) {
+		for (size_t byte = 0; byte < 256; byte++) {
+			uint32_t previous = tables[table - 1][byte];
+			tables[table][byte] = (previous >> 8) ^ tables[0][previous & 0xFF];
+		}
+	}
+	return tables;
+}();
+
+
+/**
+ * Slicing-by-8 CRC-32.
+ * @param crc - the running CRC, not inverted at either end.
+ * @param data - the bytes to add.
+ * @param size - the number of bytes.
+ */
+uint32_t crc32_slice8(uint32_t crc, const uint8_t* data, size_t size) {
+	const auto& table = Crc32Tables;
+	if constexpr (std::endian::native == std::endian::little) {
+		for (; size >= 8; data += 8, size -= 8) {
+			uint32_t low, high;
+			std::memcpy(&low, data, 4);
+			std::memcpy(&high, data + 4, 4);
+			low ^= crc;
+			crc = table[7][low & 0xFF] ^ table[6][(low >> 8) & 0xFF] ^ table[5][(low >> 16) & 0xFF] ^ table[4][low >> 24]
+				^ table[3][high & 0xFF] ^ table[2][(high >> 8) & 0xFF] ^ table[1][(high >> 16) & 0xFF] ^ table[0][high >> 24];
+		}
+	}
+	for (; size > 0; data++, size--) {
+		crc = (crc >> 8) ^ table[0][(crc ^ *data) & 0xFF];
+	}
+	return crc;
+}
+
+
+#if defined(HAS_SSE2)
+/**
+ * Fold a 128-bit CRC lane forward over the next 16 bytes.
+ */
+TARGET_CLMUL inline __m128i fold_lane(__m128i lane, __m128i next, __m128i k) {
+	__m128i low = _mm_clmulepi64_si128(lane, k, 0x00);
+	__m128i high = _mm_clmulepi64_si128(lane, k, 0x11);
+	return _mm_xor_si128(_mm_xor_si128(high, low), next);
+}
+
+
+/**
+ * PCLMULQDQ CRC-32, after Intel's "Fast CRC Computation for Generic
+ * Polynomials Using PCLMULQDQ Instruction". Four 128-bit lanes are folded
+ * 64 bytes at a time, then folded into one lane, then Barrett reduced to 32
+ * bits. Inputs under 64 bytes and the last size % 16 bytes go to the table.
+ * @param crc - the running CRC, not inverted at either end.
+ * @param data - the bytes to add.
+ * @param size - the number of bytes.
+ */
+TARGET_CLMUL uint32_t crc32_clmul(uint32_t crc, const uint8_t* data, size_t size) {
+	if (size < 64) {
+		return crc32_slice8(crc, data, size);
+	}
+	alignas(16) static const uint64_t k1k2[] = { 0x0154442BD4, 0x01C6E41596 }; // x^(512+64) and x^512 mod P.
+	alignas(16) static const uint64_t k3k4[] = { 0x01751997D0, 0x00CCAA009E }; // x^(128+64) and x^128 mod P.
+	alignas(16) static const uint64_t k5k0[] = { 0x0163CD6124, 0x0000000000 }; // x^64 mod P.
+	alignas(16) static const uint64_t poly[] = { 0x01DB710641, 0x01F7011641 }; // P and its Barrett constant.
+
+	__m128i x1 = _mm_loadu_si128((const __m128i*)(data + 0x00));
+	__m128i x2 = _mm_loadu_si128((const __m128i*)(data + 0x10));
+	__m128i x3 = _mm_loadu_si128((const __m128i*)(data + 0x20));
+	__m128i x4 = _mm_loadu_si128((const __m128i*)(data + 0x30));
+	x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128((int)crc));
+	__m128i k = _mm_load_si128((const __m128i*)k1k2);
+	data += 64;
+	size -= 64;
+
+	// Fold four lanes 64 bytes at a time.
+	for (; size >= 64; data += 64, size -= 64) {
+		__m128i x5 = _mm_clmulepi64_si128(x1, k, 0x00);
+		__m128i x6 = _mm_clmulepi64_si128(x2, k, 0x00);
+		__m128i x7 = _mm_clmulepi64_si128(x3, k, 0x00);
+		__m128i x8 = _mm_clmulepi64_si128(x4, k, 0x00);
+		x1 = _mm_clmulepi64_si128(x1, k, 0x11);
+		x2 = _mm_clmulepi64_si128(x2, k, 0x11);
+		x3 = _mm_clmulepi64_si128(x3, k, 0x11);
+		x4 = _mm_clmulepi64_si128(x4, k, 0x11);
+		x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), _mm_loadu_si128((const __m128i*)(data + 0x00)));
+		x2 = _mm_xor_si128(_mm_xor_si128(x2, x6), _mm_loadu_si128((const __m128i*)(data + 0x10)));
+		x3 = _mm_xor_si128(_mm_xor_si128(x3, x7), _mm_loadu_si128((const __m128i*)(data + 0x20)));
+		x4 = _mm_xor_si128(_mm_xor_si128(x4, x8), _mm_loadu_si128((const __m128i*)(data + 0x30)));
+	}
+
+	// Fold the four lanes into one, then any whole 16 bytes left.
+	k = _mm_load_si128((const __m128i*)k3k4);
+	x1 = fold_lane(x1, x2, k);
+	x1 = fold_lane(x1, x3, k);
+	x1 = fold_lane(x1, x4, k);
+	for (; size >= 16; data += 16, size -= 16) {
+		x1 = fold_lane(x1, _mm_loadu_si128((const __m128i*)data), k);
+	}
+
+	// Fold 128 bits to 64.
+	__m128i mask = _mm_setr_epi32(~0, 0, ~0, 0);
+	x2 = _mm_clmulepi64_si128(x1, k, 0x10);
+	x1 = _mm_xor_si128(_mm_srli_si128(x1, 8), x2);
+	k = _mm_loadl_epi64((const __m128i*)k5k0);
+	x2 = _mm_srli_si128(x1, 4);
+	x1 = _mm_clmulepi64_si128(_mm_and_si128(x1, mask), k, 0x00);
+	x1 = _mm_xor_si128(x1, x2);
+
+	// Barrett reduce to 32 bits.
+	k = _mm_load_si128((const __m128i*)poly);
+	x2 = _mm_clmulepi64_si128(_mm_and_si128(x1, mask), k, 0x10);
+	x2 = _mm_clmulepi64_si128(_mm_and_si128(x2, mask), k, 0x00);
+	x1 = _mm_xor_si128(x1, x2);
+	crc = (uint32_t)_mm_extract_epi32(x1, 1);
+
+	return crc32_slice8(crc, data, size);
+}
+#endif
+
+
+/**
+ * The PNG writer's CRC-32 (the STBIW_CRC32 hook), using the fastest kernel
+ * the processor supports.
+ * @param buffer - the bytes to check.
+ * @param size - the number of bytes.
+ */
+unsigned int png_crc32(unsigned char* buffer, int size) {
+#if defined(HAS_SSE2)
+	static const auto kernel = cpu_has_clmul() ? crc32_clmul : crc32_slice8;
+#else
+	static const auto kernel = crc32_slice8;
+#endif
+	return ~kernel(~0u, buffer, (size_t)size);
+}
+
+
+/**
+ * Scalar Adler-32.
+ * @param adler - the running checksum, 1 to start.
+ * @param data - the bytes to add.
+ * @param size - the number of bytes.
+ */
+uint32_t adler32_scalar(uint32_t adler, const uint8_t* data, size_t size) {
+	uint32_t s1 = adler & 0xFFFF;
+	uint32_t s2 = adler >> 16;
+	while (size > 0) {
+		size_t block = std::min(size, AdlerBlock);
+		for (size_t i = 0; i < block; i++) {
+			s1 += data[i];
+			s2 += s1;
+		}
+		s1 %= AdlerModulus;
+		s2 %= AdlerModulus;
+		data += block;
+		size -= block;
+	}
+	return (s2 << 16) | s1;
+}
+
+
+#if defined(HAS_SSE2)
+/**
+ * SSSE3 Adler-32. Takes 32 bytes a step: s1 is a plain byte sum (sad), and
+ * s2 adds each byte weighted by its distance from the end of the step
+ * (maddubs), plus 32 times s1 from before the step.
+ * @param adler - the running checksum, 1 to start.
+ * @param data - the bytes to add.
+ * @param size - the number of bytes.
+ */
+TARGET_SSSE3 uint32_t adler32_ssse3(uint32_t adler, const uint8_t* data, size_t size) {
+	constexpr size_t Step = 32;
+	uint32_t s1 = adler & 0xFFFF;
+	uint32_t s2 = adler >> 16;
+	const __m128i weights_high = _mm_setr_epi8(32, 31, 30, 29, 28, 27, 26, 25, 24, 23, 22, 21, 20, 19, 18, 17);
+	const __m128i weights_low = _mm_setr_epi8(16, 15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1);
+	const __m128i ones = _mm_set1_epi16(1);
+	const __m128i zero = _mm_setzero_si128();
+
+	while (size >= Step) {
+		size_t steps = std::min(size, AdlerBlock) / Step;
+		__m128i previous = _mm_setzero_si128(); // Sum of s1 before each step.
+		__m128i sum1 = _mm_setzero_si128();
+		__m128i sum2 = _mm_cvtsi32_si128((int)s2);
+		size -= steps * Step;
+		__m128i start = _mm_cvtsi32_si128((int)(s1 * steps)); // s1 from before the block, once per step.
+		for (; steps > 0; steps--, data += Step) {
+			__m128i first = _mm_loadu_si128((const __m128i*)data);
+			__m128i second = _mm_loadu_si128((const __m128i*)(data + 16));
+			previous = _mm_add_epi32(previous, sum1);
+			sum1 = _mm_add_epi32(sum1, _mm_add_epi32(_mm_sad_epu8(first, zero), _mm_sad_epu8(second, zero)));
+			sum2 = _mm_add_epi32(sum2, _mm_madd_epi16(_mm_maddubs_epi16(first, weights_high), ones));
+			sum2 = _mm_add_epi32(sum2, _mm_madd_epi16(_mm_maddubs_epi16(second, weights_low), ones));
+		}
+		sum2 = _mm_add_epi32(sum2, _mm_slli_epi32(_mm_add_epi32(previous, start), 5));
+
+		sum1 = _mm_add_epi32(sum1, _mm_shuffle_epi32(sum1, _MM_SHUFFLE(1, 0, 3, 2)));
+		sum2 = _mm_add_epi32(sum2, _mm_shuffle_epi32(sum2, _MM_SHUFFLE(2, 3, 0, 1)));
+		sum2 = _mm_add_epi32(sum2, _mm_shuffle_epi32(sum2, _MM_SHUFFLE(1, 0, 3, 2)));
+		s1 = (s1 + (uint32_t)_mm_cvtsi128_si32(sum1)) % AdlerModulus;
+		s2 = (uint32_t)_mm_cvtsi128_si32(sum2) % AdlerModulus;
+	}
+	return adler32_scalar((s2 << 16) | s1, data, size);
+}
+#endif
+
+
+/**
+ * The PNG writer's Adler-32 (the STBIW_ADLER32 hook), using the fastest
+ * kernel the processor supports.
+ * @param data - the bytes to check.
+ * @param size - the number of bytes.
+ */
+unsigned int png_adler32(unsigned char* data, int size) {
+#if defined(HAS_SSE2)
+	static const auto kernel = cpu_has_ssse3() ? adler32_ssse3 : adler32_scalar;
+#else
+	static const auto kernel = adler32_scalar;
+#endif
+	return kernel(1, data, (size_t)size);
+}
+
+
+/**
+ * Add the sub-histograms into the histogram and clear them for reuse.
+ * @param sub - the interleaved sub-histograms.
+ * @param count - the histogram to add to.
+ */
+void merge_sub_histograms(uint32_t (*sub)[256], size_t* count) {
+	for (size_t table = 0; table < SubHistograms; table++) {
+		for (size_t index = 0; index < 256; index++) {
+			count[index] += sub[table][index];
+		}
+	}
+	std::memset(sub, 0, sizeof(uint32_t) * SubHistograms * 256);
+}
+
+
+/**
+ * Count every stride-th pixel into the histogram. Neighbouring samples are
+ * counted into different sub-histograms so that runs of the same value do
+ * not stall on the previous increment of the same bin.
+ * @param pixels - the pixels to count.
+ * @param size - the number of pixels.
+ * @param stride - the distance between counted pixels.
+ * @param count - the histogram to add to.
+ */
+template <typename Pixel>
+void histogram_strided(const Pixel* pixels, size_t size, size_t stride, size_t* count) {
+	if constexpr (PixelTraits<Pixel>::BitDepth <= 8) {
+		alignas(CacheLine) uint32_t sub[SubHistograms][PixelTraits<Pixel>::Bins] = {};
+
+		for (size_t block = 0; block < size; block += SubHistogramBlock) {
+			size_t end = std::min(size, block + SubHistogramBlock);
+			size_t pixel = block + (stride - block % stride) % stride;
+			for (; pixel + 3 * stride < end; pixel += 4 * stride) {
+				sub[0][pixels[pixel]]++;
+				sub[1][pixels[pixel + stride]]++;
+				sub[2][pixels[pixel + 2 * stride]]++;
+				sub[3][pixels[pixel + 3 * stride]]++;
+			}
+			for (; pixel < end; pixel += stride) {
+				sub[0][pixels[pixel]]++;
+			}
+			merge_sub_histograms(sub, count);
+		}
+	} else {
+		for (size_t pixel = 0; pixel < size; pixel += stride) {
+			count[pixels[pixel]]++;
+		}
+	}
+}
+
+
+#if defined(HAS_SSE2)
+/**
+ * Count the eight pixels packed into a 64-bit word, one per sub-histogram.
+ */
+inline void count_word(uint32_t (*sub)[256], uint64_t word) {
+	sub[0][word & 0xFF]++;
+	sub[1][(word >> 8) & 0xFF]++;
+	sub[2][(word >> 16) & 0xFF]++;
+	sub[3][(word >> 24) & 0xFF]++;
+	sub[4][(word >> 32) & 0xFF]++;
+	sub[5][(word >> 40) & 0xFF]++;
+	sub[6][(word >> 48) & 0xFF]++;
+	sub[7][word >> 56]++;
+}
+
+
+/**
+ * SSE2 histogram kernel. Loads 16 pixels at a time and, when they are all the
+ * same value (the background of a document scan), counts them with a single
+ * add. Otherwise each pixel goes to one of eight interleaved sub-histograms.
+ * At most SubHistogramBlock pixels may be counted before the sub-histograms
+ * are merged.
+ */
+void count_sse2(uint32_t (*sub)[256], const stbi_uc* pixels, size_t size) {
+	size_t pixel = 0;
+	for (; pixel + 16 <= size; pixel += 16) {
+		__m128i vector = _mm_loadu_si128((const __m128i*)(pixels + pixel));
+		__m128i first = _mm_set1_epi8((char)pixels[pixel]);
+		if (_mm_movemask_epi8(_mm_cmpeq_epi8(vector, first)) == 0xFFFF) {
+			sub[0][pixels[pixel]] += 16;
+			continue;
+		}
+		count_word(sub, (uint64_t)_mm_cvtsi128_si64(vector));
+		count_word(sub, (uint64_t)_mm_cvtsi128_si64(_mm_srli_si128(vector, 8)));
+	}
+	for (; pixel < size; pixel++) {
+		sub[0][pixels[pixel]]++;
+	}
+}
+
+
+/**
+ * AVX2 histogram kernel. Same as the SSE2 kernel but checks 32 pixels at a
+ * time for a uniform run.
+ */
+TARGET_AVX2 void count_avx2(uint32_t (*sub)[256], const stbi_uc* pixels, size_t size) {
+	size_t pixel = 0;
+	for (; pixel + 32 <= size; pixel += 32) {
+		__m256i vector = _mm256_loadu_si256((const __m256i*)(pixels + pixel));
+		__m256i first = _mm256_set1_epi8((char)pixels[pixel]);
+		if (_mm256_movemask_epi8(_mm256_cmpeq_epi8(vector, first)) == -1) {
+			sub[0][pixels[pixel]] += 32;
+			continue;
+		}
+		count_word(sub, (uint64_t)_mm256_extract_epi64(vector, 0));
+		count_word(sub, (uint64_t)_mm256_extract_epi64(vector, 1));
+		count_word(sub, (uint64_t)_mm256_extract_epi64(vector, 2));
+		count_word(sub, (uint64_t)_mm256_extract_epi64(vector, 3));
+	}
+	for (; pixel < size; pixel++) {
+		sub[0][pixels[pixel]]++;
+	}
+}
+#endif
+
+
+/**
+ * Hint to the processor that the memory will be read soon.
+ * @param address - the address to fetch into cache.
+ */
+inline void prefetch(const void* address) {
+#if defined(HAS_SSE2)
+	_mm_prefetch((const char*)address, _MM_HINT_T0);
+#endif
+}
+
+
+/**
+ * Count the first block pixels out of every step pixels into the histogram,
+ * using the fastest kernel the processor supports. Blocks further ahead are
+ * prefetched, as sparse blocks defeat the hardware prefetcher.
+ * @param pixels - the pixels to count.
+ * @param size - the number of pixels.
+ * @param block - the number of contiguous pixels counted at each step.
+ * @param step - the distance between the start of each block.
+ * @param count - the histogram to add to.
+ */
+template <typename Pixel>
+void histogram_blocks(const Pixel* pixels, size_t size, size_t block, size_t step, size_t* count) {
+#if defined(HAS_SSE2)
+	if constexpr (PixelTraits<Pixel>::BitDepth <= 8) {
+		static const auto kernel = cpu_has_avx2() ? count_avx2 : count_sse2;
+		alignas(CacheLine) uint32_t sub[SubHistograms][PixelTraits<Pixel>::Bins] = {};
+		size_t pending = 0;
+
+		for (size_t begin = 0; begin < size; begin += step) {
+			if (step < size - begin && PrefetchDistance * step < size - begin) {
+				prefetch(pixels + begin + PrefetchDistance * step);
+			}
+			size_t length = std::min(block, size - begin);
+			for (size_t offset = 0; offset < length;) {
+				size_t chunk = std::min(length - offset, SubHistogramBlock - pending);
+				kernel(sub, pixels + begin + offset, chunk);
+				offset += chunk;
+				pending += chunk;
+				if (pending == SubHistogramBlock) {
+					merge_sub_histograms(sub, count);
+					pending = 0;
+				}
+			}
+		}
+		merge_sub_histograms(sub, count);
+		return;
+	}
+#endif
+	for (size_t begin = 0; begin < size; begin += step) {
+		if (PrefetchDistance * step < size - begin) {
+			prefetch(pixels + begin + PrefetchDistance * step);
+		}
+		size_t end = begin + std::min(block, size - begin);
+		for (size_t pixel = begin; pixel < end; pixel++) {
+			count[pixels[pixel]]++;
+		}
+	}
+}
+
+
+/**
+ * Count every pixel into the histogram, using the fastest kernel the
+ * processor supports.
+ * @param pixels - the pixels to count.
+ * @param size - the number of pixels.
+ * @param count - the histogram to add to.
+ */
+template <typename Pixel>
+void histogram(const Pixel* pixels, size_t size, size_t* count) {
+	histogram_blocks(pixels, size, size, size, count);
+}
+
+
+/**
+ * Estimate how many bytes of the image are pulled into cache when every
+ * stride-th pixel is read. Each cache line touched is loaded in full.
+ * @param image_size - the number of pixels in the image.
+ * @param stride - the distance between pixels read.
+ */
+template <typename Pixel>
+size_t strided_bytes(size_t image_size, size_t stride) {
+	size_t lines = (image_size * sizeof(Pixel) + CacheLine - 1) / CacheLine;
+	size_t samples = (image_size + stride - 1) / stride;
+	return std::min(lines, samples) * CacheLine;
+}
+
+
+/**
+ * A cumulative histogram of pixel values. Built once from an image (or a
+ * sample of one), it can then find the threshold for any number of ratios
+ * with a binary search, without reading the pixels again.
+ */
+template <typename Pixel>
+class Histogram {
+public:
+	/**
+	 * @param count - the histogram, one bin per pixel value.
+	 */
+	template <typename Count>
+	explicit Histogram(const Count* count) : cumulative(PixelTraits<Pixel>::Bins) {
+		std::inclusive_scan(count, count + PixelTraits<Pixel>::Bins, cumulative.begin(), std::plus<size_t>(), size_t(0));
+	}
+
+	/**
+	 * The number of pixels counted.
+	 */
+	size_t samples() const {
+		return cumulative.back();
+	}
+
+	/**
+	 * Find the same threshold as find_threshold would on the histogram.
+	 * @param ratio - the ratio of black to white pixels.
+	 */
+	Pixel threshold(float ratio) const {
+		size_t cutoff = samples() * ratio;
+		// An empty cutoff walks no bins and wraps around to the max value.
+		if (cutoff == 0) return PixelTraits<Pixel>::Max;
+		return std::lower_bound(cumulative.begin(), cumulative.end(), cutoff) - cumulative.begin();
+	}
+
+	/**
+	 * Find the threshold for each of the ratios.
+	 * @param ratios - the ratios of black to white pixels.
+	 */
+	std::vector<Pixel> thresholds(const std::vector<float>& ratios) const {
+		std::vector<Pixel> result(ratios.size());
+		std::transform(ratios.begin(), ratios.end(), result.begin(), [this](float ratio) {
+			return threshold(ratio);
+		});
+		return result;
+	}
+
+private:
+	std::vector<size_t> cumulative;
+};
+
+
+/**
+ * Build a cumulative histogram of every pixel, as the counting sort does.
+ * @param greyscale - the reference image.
+ * @param width - the width of the image.
+ * @param height - the height of the image.
+ */
+template <typename Pixel>
+Histogram<Pixel> counting_histogram(const Pixel* greyscale, int width, int height) {
+	std::unique_ptr<size_t[]> count = std::make_unique<size_t[]>(PixelTraits<Pixel>::Bins);
+	histogram(greyscale, (size_t)width * height, count.get());
+	return Histogram<Pixel>(count.get());
+}
+
+
+/**
+ * Build a cumulative histogram of every sample_rate-th pixel, as the uniform
+ * sample does.
+ * @param greyscale - the reference image.
+ * @param width - the width of the image.
+ * @param height - the height of the image.
+ * @param sample_rate - how often to sample the image.
+ */
+template <typename Pixel>
+Histogram<Pixel> uniform_sample_histogram(const Pixel* greyscale, int width, int height, unsigned int sample_rate) {
+	std::unique_ptr<size_t[]> count = std::make_unique<size_t[]>(PixelTraits<Pixel>::Bins);
+	histogram_strided(greyscale, (size_t)width * height, sample_rate, count.get());
+	return Histogram<Pixel>(count.get());
+}
+
+
+/**
+ * Summary statistics of an image, gathered in a single pass.
+ */
+template <typename Pixel>
+struct Moments {
+	size_t count = 0;
+	uint64_t sum = 0;
+	uint64_t sum_squares = 0;
+	Pixel min = std::numeric_limits<Pixel>::max();
+	Pixel max = 0;
+};
+
+
+/**
+ * Add the pixels to the moments one at a time.
+ * @param pixels - the pixels to add.
+ * @param size - the number of pixels.
+ * @param moments - the moments to add to.
+ */
+template <typename Pixel>
+void moments_scalar(const Pixel* pixels, size_t size, Moments<Pixel>& moments) {
+	for (size_t pixel = 0; pixel < size; pixel++) {
+		uint64_t value = pixels[pixel];
+		moments.sum += value;
+		moments.sum_squares += value * value;
+		moments.min = std::min(moments.min, pixels[pixel]);
+		moments.max = std::max(moments.max, pixels[pixel]);
+	}
+	moments.count += size;
+}
+
+
+#if defined(HAS_SSE2)
+/**
+ * SSE2 moments kernel. Sums come from _mm_sad_epu8 straight into 64-bit
+ * lanes. Squares are summed with _mm_madd_epi16 into 32-bit lanes, which are
+ * widened into 64-bit lanes before they can overflow.
+ */
+void moments_sse2(const stbi_uc* pixels, size_t size, Moments<stbi_uc>& moments) {
+	// Each 32-bit lane gains at most 4 * 255^2 per vector.
+	constexpr size_t FlushInterval = 4096;
+	const __m128i zero = _mm_setzero_si128();
+	__m128i sum = zero;
+	__m128i squares = zero;
+	__m128i min = _mm_set1_epi8((char)0xFF);
+	__m128i max = zero;
+	size_t pixel = 0;
+
+	while (pixel + 16 <= size) {
+		__m128i partial = zero;
+		size_t end = std::min(size - 15, pixel + FlushInterval * 16);
+		for (; pixel < end; pixel += 16) {
+			__m128i vector = _mm_loadu_si128((const __m128i*)(pixels + pixel));
+			__m128i low = _mm_unpacklo_epi8(vector, zero);
+			__m128i high = _mm_unpackhi_epi8(vector, zero);
+			sum = _mm_add_epi64(sum, _mm_sad_epu8(vector, zero));
+			partial = _mm_add_epi32(partial, _mm_madd_epi16(low, low));
+			partial = _mm_add_epi32(partial, _mm_madd_epi16(high, high));
+			min = _mm_min_epu8(min, vector);
+			max = _mm_max_epu8(max, vector);
+		}
+		squares = _mm_add_epi64(squares, _mm_unpacklo_epi32(partial, zero));
+		squares = _mm_add_epi64(squares, _mm_unpackhi_epi32(partial, zero));
+	}
+
+	alignas(16) uint64_t lanes[2];
+	_mm_store_si128((__m128i*)lanes, sum);
+	moments.sum += lanes[0] + lanes[1];
+	_mm_store_si128((__m128i*)lanes, squares);
+	moments.sum_squares += lanes[0] + lanes[1];
+
+	alignas(16) stbi_uc extremes[16];
+	_mm_store_si128((__m128i*)extremes, min);
+	moments.min = std::min(moments.min, *std::min_element(extremes, extremes + 16));
+	_mm_store_si128((__m128i*)extremes, max);
+	moments.max = std::max(moments.max, *std::max_element(extremes, extremes + 16));
+
+	moments.count += pixel;
+	moments_scalar(pixels + pixel, size - pixel, moments);
+}
+#endif
+
+
+/**
+ * Find the count, sum, sum of squares, min and max of the image in one pass.
+ * @param greyscale - the reference image.
+ * @param width - the width of the image.
+ * @param height - the height of the image.
+ */
+template <typename Pixel>
+Moments<Pixel> image_moments(const Pixel* greyscale, int width, int height) {
+	Moments<Pixel> moments;
+	size_t image_size = (size_t)width * height;
+	if (image_size == 0) return moments;
+#if defined(HAS_SSE2)
+	if constexpr (PixelTraits<Pixel>::BitDepth <= 8) {
+		moments_sse2(greyscale, image_size, moments);
+		return moments;
+	}
+#endif
+	moments_scalar(greyscale, image_size, moments);
+	return moments;
+}
+
+
+/**
+ * Normal Distribution Approximation of the threshold value.
+ * @param moments - the moments of the reference image.
+ * @param ratio - the ratio of black to white pixels.
+ */
+template <typename Pixel>
+Pixel normal_estimate(const Moments<Pixel>& moments, float ratio) {
+	Pixel average = moments.sum / moments.count;
+
+	// Sum of (pixel - average)^2, expanded so it can be found from the
+	// moments. Unsigned wraparound cancels out as the result is positive.
+	uint64_t sigma_total = moments.sum_squares - 2 * (uint64_t)average * moments.sum
+		+ (uint64_t)moments.count * average * average;
+	float sigma = std::sqrt((float)sigma_total * (1.0f / moments.count));
+
+	// Approximate z value using polynomial.
+	float approximation = ratio + std::pow(ratio, 3.0f) + std::pow(ratio, 5.0f) + std::pow(ratio, 7.0f);
+	float z = std::numbers::sqrt2 * approximation; 
+	return (Pixel)((float)average + (z * sigma)); // CDF.
+}
+
+
+/**
+ * Normal Distribution Approximation of the threshold value.
+ * @param greyscale - the reference image.
+ * @param width - the width of the image.
+ * @param height - the height of the image.
+ * @param ratio - the ratio of black to white pixels.
+ */
+template <typename Pixel>
+Pixel normal_estimate(Pixel* greyscale, int width, int height, float ratio) {
+	return normal_estimate(image_moments(greyscale, width, height), ratio);
+}
+
+
+/**
+ * Approximation of the threshold value using linear interpolation and the
+ * average.
+ * @param moments - the moments of the reference image.
+ * @param ratio - the ratio of black to white pixels.
+ */
+template <typename Pixel>
+Pixel weighted_estimate(const Moments<Pixel>& moments, float ratio) {
+	Pixel average = moments.sum / moments.count;
+
+	Pixel min, max;
+	if (ratio > 0.5) {
+		min = average;
+		max = PixelTraits<Pixel>::Max;
+	} else {
+		min = 0;
+		max = average;
+	}
+	
+	if (ratio > 0.5) ratio -= 0.5;
+	float percentage = ratio / 0.5f;
+	return min + ((max - min) * percentage);
+}
+
+
+/**
+ * Approximation of the threshold value using linear interpolation and the
+ * average.
+ * @param greyscale - the reference image.
+ * @param width - the width of the image.
+ * @param height - the height of the image.
+ * @param ratio - the ratio of black to white pixels.
+ */
+template <typename Pixel>
+Pixel weighted_estimate(Pixel* greyscale, int width, int height, float ratio) {
+	return weighted_estimate(image_moments(greyscale, width, height), ratio);
+}
+
+
+/**
+ * Sort the image using std::sort to find the threshold value that will
+ * produce a binary image with a black-white ratio closest to the given
+ * ratio. std::sort works in place, so a copy of the image is sorted.
+ * @param greyscale - the reference image.
+ * @param width - the width of the image.
+ * @param height - the height of the image.
+ * @param ratio - the ratio of black to white pixels.
+ */
+template <typename Pixel>
+Pixel std_sort(const Pixel* greyscale, int width, int height, float ratio) {
+	int n = (width * height) * ratio;
+	std::vector<Pixel> sorted(greyscale, greyscale + (width * height));
+	std::sort(sorted.begin(), sorted.end());
+	return sorted[n];
+}
+
+
+/**
+ * Find the value at index n of every stride-th pixel, sorted, using a two
+ * level radix select. The high byte is counted first to find the bucket
+ * holding index n, then only the pixels in that bucket are counted by their
+ * low byte. Both passes use 256 bins, so the counts stay in L1 rather than
+ * spilling the 1 << 16 bins of a flat histogram out of cache. Only used for
+ * pixels wider than 8 bits.
+ * @param pixels - the pixels to select from.
+ * @param size - the number of pixels.
+ * @param stride - the distance between selected pixels.
+ * @param n - the index into the sorted pixels.
+ */
+template <typename Pixel>
+Pixel radix_select(const Pixel* pixels, size_t size, size_t stride, size_t n) {
+	size_t count[256] = {};
+	size_t total = 0;
+	size_t index = 0;
+
+	// Past the last sample, select the largest (as exact_select does).
+	size_t samples = (size + stride - 1) / stride;
+	n = std::min(n, std::max<size_t>(samples, 1) - 1);
+
+	for (size_t pixel = 0; pixel < size; pixel += stride) {
+		count[pixels[pixel] >> PixelTraits<Pixel>::RadixShift]++;
+	}
+	while (index < 255 && total + count[index] <= n) {
+		total += count[index++];
+	}
+	Pixel high = index;
+
+	std::memset(count, 0, sizeof(count));
+	for (size_t pixel = 0; pixel < size; pixel += stride) {
+		if ((pixels[pixel] >> PixelTraits<Pixel>::RadixShift) == high) {
+			count[pixels[pixel] & PixelTraits<Pixel>::RadixMask]++;
+		}
+	}
+	index = 0;
+	while (index < 255 && total + count[index] <= n) {
+		total += count[index++];
+	}
+	return (high << PixelTraits<Pixel>::RadixShift) | index;
+}
+
+
+/**
+ * Find the same threshold as find_threshold on a flat histogram of every
+ * stride-th pixel, using a radix select.
+ * @param pixels - the pixels to count.
+ * @param size - the number of pixels.
+ * @param stride - the distance between counted pixels.
+ * @param cutoff - the number of pixels that should fall below the threshold.
+ */
+template <typename Pixel>
+Pixel radix_threshold(const Pixel* pixels, size_t size, size_t stride, size_t cutoff) {
+	// An empty cutoff walks no bins and wraps around to the max value.
+	if (cutoff == 0) return PixelTraits<Pixel>::Max;
+	return radix_select(pixels, size, stride, cutoff - 1);
+}
+
+
+/**
+ * @brief Sort the image using a counting sort to find the threshold value that
+ * will produce a binary image with a black-white ratio closest to the given
+ * ratio.
+ * @param greyscale - the reference image.
+ * @param width - the width of the image.
+ * @param height - the height of the image.
+ * @param ratio - the ratio of black to white pixels.
+ */
+template <typename Pixel>
+Pixel counting_sort(Pixel* greyscale, int width, int height, float ratio) {
+	if constexpr (PixelTraits<Pixel>::BitDepth <= 8) {
+		return counting_histogram(greyscale, width, height).threshold(ratio);
+	} else {
+		size_t image_size = width * height;
+		return radix_threshold(greyscale, image_size, 1, image_size * ratio);
+	}
 }
 
 
 /**
- * Normal Distribution Approximation of the threshold value.
+ * @brief Multithreaded version of the counting sort. The image is split into
+ * equal ranges, one per thread, and each thread counts its range into its own
+ * cache-aligned bins so that no two threads write to the same cache line. The
+ * bins are merged once all threads have finished.
  * @param greyscale - the reference image.
  * @param width - the width of the image.
  * @param height - the height of the image.
  * @param ratio - the ratio of black to white pixels.
+ * @param threads - the number of threads to split the image across.
  */
-Pixel normal_estimate(Pixel* greyscale, int width, int height, float ratio) {
-	size_t total = 0;
-	for (int pixel = 0; pixel < width * height; pixel++) {
-		total += greyscale[pixel];
-	}
-	Pixel average = total / (width * height);
+template <typename Pixel>
+Pixel parallel_counting_sort(Pixel* greyscale, int width, int height, float ratio, unsigned int threads) {
+	struct alignas(CacheLine) Bins {
+		size_t count[PixelTraits<Pixel>::Bins];
+	};
+	std::unique_ptr<Bins[]> bins = std::make_unique<Bins[]>(threads);
+	size_t image_size = width * height;
 
-	size_t sigma_total = 0;
-	for (int pixel = 0; pixel < width * height; pixel++) {
-		sigma_total += std::pow(greyscale[pixel] - average, 2);
-	}
-	float sigma = std::sqrt((float)sigma_total * (1.0f / (width * height)));
+	parallel_for(image_size, threads, [&](unsigned int thread, size_t begin, size_t end) {
+		histogram(greyscale + begin, end - begin, bins[thread].count);
+	});
 
-	// Approximate z value using polynomial.
-	float approximation = ratio + std::pow(ratio, 3.0f) + std::pow(ratio, 5.0f) + std::pow(ratio, 7.0f);
-	float z = std::numbers::sqrt2 * approximation; 
-	return (Pixel)((float)average + (z * sigma)); // CDF.
+	for (unsigned int thread = 1; thread < threads; thread++) {
+		for (size_t index = 0; index < PixelTraits<Pixel>::Bins; index++) {
+			bins[0].count[index] += bins[thread].count[index];
+		}
+	}
+	return find_threshold<Pixel>(bins[0].count, image_size * ratio);
 }
 
 
 /**
- * Approximation of the threshold value using linear interpolation and the
- * average.
+ * Find the threshold value using std::nth_element that will produce a binary
+ * image with a black-white ratio closest to the given ratio. std::nth_element
+ * works in place, so a copy of the image is partitioned.
  * @param greyscale - the reference image.
  * @param width - the width of the image.
  * @param height - the height of the image.
  * @param ratio - the ratio of black to white pixels.
  */
-Pixel weighted_estimate(Pixel* greyscale, int width, int height, float ratio) {
-	size_t total = 0;
-	for (int pixel = 0; pixel < width * height; pixel++) {
-		total += greyscale[pixel];
-	}
-	Pixel average = total / (width * height);
+template <typename Pixel>
+Pixel nth_element_sort(const Pixel* greyscale, int width, int height, float ratio) {
+	size_t n = (width * height) * ratio;
+	std::vector<Pixel> partitioned(greyscale, greyscale + (width * height));
+	std::nth_element(partitioned.begin(), partitioned.begin() + n, partitioned.end());
+	return partitioned[n];
+}
 
-	Pixel min, max;
-	if (ratio > 0.5) {
-		min = average;
-		max = (1 << BIT_DEPTH) - 1;
+
+/**
+ * Find the value at index n of the sorted pixels without modifying them.
+ * 8-bit pixels are counted into a histogram. Wider pixels use radix_select.
+ * @param pixels - the pixels to select from.
+ * @param size - the number of pixels.
+ * @param n - the index into the sorted pixels.
+ */
+template <typename Pixel>
+Pixel select_nth(const Pixel* pixels, size_t size, size_t n) {
+	if constexpr (PixelTraits<Pixel>::BitDepth <= 8) {
+		size_t count[PixelTraits<Pixel>::Bins] = {};
+		size_t total = 0;
+		size_t index = 0;
+
+		// Past the last pixel, select the largest (as radix_select does).
+		histogram(pixels, size, count);
+		while (index < PixelTraits<Pixel>::Bins - 1 && total + count[index] <= n) {
+			total += count[index++];
+		}
+		return index;
 	} else {
-		min = 0;
-		max = average;
+		return radix_select(pixels, size, 1, n);
 	}
-	
-	if (ratio > 0.5) ratio -= 0.5;
-	float percentage = ratio / 0.5f;
-	return min + ((max - min) * percentage);
 }
 
 
 /**
- * Sort the image using std::sort to find the threshold value that will
- * produce a binary image with a black-white ratio closest to the given
- * ratio.
+ * Find the same threshold value as std_sort and nth_element_sort, without
+ * reordering or copying the image.
  * @param greyscale - the reference image.
  * @param width - the width of the image.
  * @param height - the height of the image.
  * @param ratio - the ratio of black to white pixels.
  */
-Pixel std_sort(Pixel* greyscale, int width, int height, float ratio) {
-	int n = (width * height) * ratio;
-	std::sort(greyscale, greyscale + (width * height));
-	return greyscale[n];
+template <typename Pixel>
+Pixel exact_select(const Pixel* greyscale, int width, int height, float ratio) {
+	size_t image_size = width * height;
+	size_t n = image_size * ratio;
+	return select_nth(greyscale, image_size, std::min(n, image_size - 1));
 }
 
 
 /**
- * @brief Sort the image using a counting sort to find the threshold value that
- * will produce a binary image with a black-white ratio closest to the given
- * ratio.
+ * Run a counting sort version on a uniform sample of the input image.
  * @param greyscale - the reference image.
  * @param width - the width of the image.
  * @param height - the height of the image.
+ * @param sample_rate - how often to sample the image (a value of 10 means
+ * 		every 10 pixels)
  * @param ratio - the ratio of black to white pixels.
  */
-Pixel counting_sort(Pixel* greyscale, int width, int height, float ratio) {
-	std::unique_ptr<size_t[]> count = std::make_unique<size_t[]>(1 << BIT_DEPTH);
+template <typename Pixel>
+Pixel uniform_sample(Pixel* greyscale, int width, int height, unsigned int sample_rate, float ratio) {
+	// Both paths count every sample_rate-th pixel, starting with the first, so
+	// the histogram's samples() is this same count.
+	size_t image_size = width * height;
+	size_t samples = (image_size + sample_rate - 1) / sample_rate;
+	if constexpr (PixelTraits<Pixel>::BitDepth <= 8) {
+		return uniform_sample_histogram(greyscale, width, height, sample_rate).threshold(ratio);
+	} else {
+		return radix_threshold(greyscale, image_size, sample_rate, samples * ratio);
+	}
+}
+
+
+/**
+ * Run a counting sort on whole cache lines sampled from the image. Unlike
+ * uniform_sample, which reads single pixels and so still loads every cache
+ * line, this reads one full cache line out of every sample_rate lines, so the
+ * memory traffic falls with the sample rate.
+ * @param greyscale - the reference image.
+ * @param width - the width of the image.
+ * @param height - the height of the image.
+ * @param sample_rate - how often to sample the image (a value of 10 means
+ * 		one cache line in every 10)
+ * @param ratio - the ratio of black to white pixels.
+ */
+template <typename Pixel>
+SampleResult<Pixel> block_sample(Pixel* greyscale, int width, int height, unsigned int sample_rate, float ratio) {
+	constexpr size_t BlockPixels = CacheLine / sizeof(Pixel);
+	std::unique_ptr<size_t[]> count = std::make_unique<size_t[]>(PixelTraits<Pixel>::Bins);
 	size_t image_size = width * height;
 
-	for (size_t pixel = 0; pixel < image_size; pixel++) {
-		count[greyscale[pixel]]++;
+	// Start on a cache line boundary so that each block is exactly one line.
+	size_t first = std::min(image_size, ((CacheLine - (uintptr_t)greyscale % CacheLine) % CacheLine) / sizeof(Pixel));
+	size_t step = BlockPixels * sample_rate;
+	histogram_blocks(greyscale + first, image_size - first, BlockPixels, step, count.get());
+
+	// Every block is whole except perhaps the last, which stops at the end.
+	size_t lines = (image_size - first + step - 1) / step;
+	size_t samples = 0;
+	if (lines > 0) {
+		size_t last = first + (lines - 1) * step;
+		samples = (lines - 1) * BlockPixels + std::min(BlockPixels, image_size - last);
 	}
+	size_t bytes = lines * CacheLine;
+	return { find_threshold<Pixel>(count.get(), samples * ratio), samples, bytes, false };
+}
 
-	size_t cutoff = image_size * ratio;
-	size_t total = 0;
-	size_t index = 0;
 
-	while (total < cutoff && index < (1 << BIT_DEPTH)) {
-		total += count[index++];
+/**
+ * SplitMix64 random number generator. Fast, seedable and deterministic, so
+ * that sampled thresholds can be reproduced.
+ */
+struct SplitMix64 {
+	uint64_t state;
+
+	uint64_t next() {
+		uint64_t z = (state += 0x9E3779B97F4A7C15ull);
+		z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+		z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+		return z ^ (z >> 31);
 	}
-	return std::max((size_t)0, index - 1);
+
+	/**
+	 * A random value in [0, bound), without a division.
+	 */
+	uint32_t below(uint32_t bound) {
+		return (uint32_t)(((next() >> 32) * bound) >> 32);
+	}
+};
+
+
+/**
+ * Count one pixel picked at random from each run of cell pixels.
+ * @param pixels - the pixels to sample.
+ * @param size - the number of pixels.
+ * @param cell - the number of pixels in each run.
+ * @param random - the random number generator.
+ * @param count - the histogram to add the samples to.
+ * @return the number of pixels counted.
+ */
+template <typename Pixel>
+size_t histogram_jittered(const Pixel* pixels, size_t size, size_t cell, SplitMix64& random, size_t* count) {
+	size_t samples = 0;
+	for (size_t start = 0; start < size; start += cell) {
+		count[pixels[start + random.below((uint32_t)std::min(cell, size - start))]]++;
+		samples++;
+	}
+	return samples;
 }
 
 
 /**
- * Find the threshold value using std::nth_element that will produce a binary
- * image with a black-white ratio closest to the given ratio.
+ * Run a counting sort on a stratified sample of the image. The image is split
+ * into a grid of cell_size x cell_size cells and one pixel is picked at random
+ * from each cell. Unlike uniform_sample, the sampled columns do not line up
+ * when the width is a multiple of the sample rate, so vertical structure in
+ * the image does not bias the threshold.
  * @param greyscale - the reference image.
  * @param width - the width of the image.
  * @param height - the height of the image.
+ * @param cell_size - the width and height of each cell.
  * @param ratio - the ratio of black to white pixels.
+ * @param seed - the seed for the random number generator.
  */
-Pixel nth_element_sort(Pixel* greyscale, int width, int height, float ratio) {
-	size_t n = (width * height) * ratio;
-	std::nth_element(greyscale, greyscale + n, greyscale + (width * height));
-	return greyscale[n];
+template <typename Pixel>
+SampleResult<Pixel> stratified_sample(Pixel* greyscale, int width, int height, unsigned int cell_size, float ratio, uint64_t seed) {
+	std::unique_ptr<size_t[]> count = std::make_unique<size_t[]>(PixelTraits<Pixel>::Bins);
+	SplitMix64 random = { seed };
+	size_t samples = 0;
+
+	// The random picks leave some cache lines unread, so mark the ones hit.
+	// Each row of cells covers a contiguous run of lines, so one bit per line
+	// of that run is enough, cleared at every new row of cells.
+	size_t row_lines = ((size_t)cell_size * width * sizeof(Pixel) + CacheLine - 1) / CacheLine + 1;
+	std::vector<uint64_t> touched((row_lines + 63) / 64);
+	uintptr_t first_line = (uintptr_t)greyscale / CacheLine;
+	size_t lines_touched = 0;
+
+	for (int cell_y = 0; cell_y < height; cell_y += cell_size) {
+		uint32_t cell_height = std::min<uint32_t>(cell_size, height - cell_y);
+
+		// The line the row starts on may hold the end of the row above.
+		uintptr_t row_line = (uintptr_t)(greyscale + (size_t)cell_y * width) / CacheLine;
+		size_t shared = row_line - first_line;
+		uint64_t carried = shared < row_lines ? touched[shared / 64] >> (shared % 64) & 1 : 0;
+		std::fill(touched.begin(), touched.end(), 0);
+		touched[0] = carried;
+		first_line = row_line;
+
+		for (int cell_x = 0; cell_x < width; cell_x += cell_size) {
+			uint32_t cell_width = std::min<uint32_t>(cell_size, width - cell_x);
+			size_t y = cell_y + random.below(cell_height);
+			size_t x = cell_x + random.below(cell_width);
+			const Pixel* pixel = greyscale + y * width + x;
+			count[*pixel]++;
+			samples++;
+
+			size_t line = (uintptr_t)pixel / CacheLine - first_line;
+			uint64_t bit = (uint64_t)1 << (line % 64);
+			lines_touched += !(touched[line / 64] & bit);
+			touched[line / 64] |= bit;
+		}
+	}
+
+	size_t bytes = lines_touched * CacheLine;
+	return { find_threshold<Pixel>(count.get(), samples * ratio), samples, bytes, false };
 }
 
 
 /**
- * Run a counting sort version on a uniform sample of the input image.
+ * Find the value below which the given fraction of the counted pixels fall,
+ * clamping the fraction so that at least one pixel is below the value.
+ * @param count - the histogram, one bin per pixel value.
+ * @param samples - the number of pixels counted.
+ * @param fraction - the fraction of pixels that should fall below the value.
+ */
+template <typename Pixel>
+Pixel quantile(const size_t* count, size_t samples, double fraction) {
+	double cutoff = std::clamp(fraction * samples, 1.0, (double)samples);
+	return find_threshold<Pixel>(count, (size_t)cutoff);
+}
+
+
+/**
+ * Sample the image progressively until the threshold is known to within a
+ * tolerance. Each round splits the image into cells of stride pixels, halving
+ * the stride each time, and counts one pixel picked at random from each cell.
+ * Every sample is drawn independently of the image content, so the DKW
+ * inequality bounds how far the sampled CDF can be from the true CDF, which
+ * gives a confidence interval on the threshold (a fixed stride would not: it
+ * can line up with periodic structure such as vertical stripes). The interval
+ * is tested after every round, so the allowed error is split evenly across
+ * the rounds and the confidence holds for the result, not just for each look.
+ * Sampling stops once that interval is within the tolerance. The rounds may
+ * load at most half of the image's bytes between them; if the next round would
+ * go over that, or the samples needed would put one in every cache line, the
+ * exact counting sort is used instead.
  * @param greyscale - the reference image.
  * @param width - the width of the image.
  * @param height - the height of the image.
- * @param sample_rate - how often to sample the image (a value of 10 means
- * 		every 10 pixels)
  * @param ratio - the ratio of black to white pixels.
+ * @param tolerance - the largest acceptable error in grey levels.
+ * @param confidence - the probability that the error is within the tolerance.
+ * @param seed - the seed for the random number generator.
  */
-Pixel uniform_sample(Pixel* greyscale, int width, int height, unsigned int sample_rate, float ratio) {
-	std::unique_ptr<size_t[]> count = std::make_unique<size_t[]>(1 << BIT_DEPTH);
+template <typename Pixel>
+SampleResult<Pixel> adaptive_sample(Pixel* greyscale, int width, int height, float ratio, unsigned int tolerance, float confidence, uint64_t seed) {
+	constexpr size_t LinePixels = CacheLine / sizeof(Pixel);
+	std::unique_ptr<size_t[]> count = std::make_unique<size_t[]>(PixelTraits<Pixel>::Bins);
+	SplitMix64 random = { seed };
 	size_t image_size = width * height;
+	size_t image_bytes = image_size * sizeof(Pixel);
+	size_t budget = image_bytes / 2;
 
-	for (size_t pixel = 0; pixel < image_size; pixel += sample_rate) {
-		count[greyscale[pixel]]++;
+	size_t stride = 1;
+	size_t rounds = 1;
+	while (stride * 2 * MinSamples <= image_size) {
+		stride *= 2;
+		rounds++;
 	}
+	double log_term = std::log(2.0 * rounds / (1.0 - confidence));
 
-	size_t cutoff = (image_size / sample_rate) * ratio;
-	size_t total = 0;
-	size_t index = 0;
+	// Too small to sample for less than the exact count costs.
+	size_t bytes = strided_bytes<Pixel>(image_size, stride);
+	if (bytes > budget) {
+		return { counting_sort(greyscale, width, height, ratio), image_size, image_bytes, true };
+	}
 
-	while (total < cutoff && index < (1 << BIT_DEPTH)) {
-		total += count[index++];
+	// A stride of one counts every pixel once, so a first round at that
+	// stride is exact.
+	bool exact = stride == 1;
+	size_t samples = histogram_jittered(greyscale, image_size, stride, random, count.get());
+
+	while (true) {
+		double epsilon = std::sqrt(log_term / (2.0 * samples));
+		Pixel threshold = find_threshold<Pixel>(count.get(), samples * ratio);
+		Pixel lower = quantile<Pixel>(count.get(), samples, ratio - epsilon);
+		Pixel upper = quantile<Pixel>(count.get(), samples, ratio + epsilon);
+		unsigned int error = std::max(threshold - lower, upper - threshold);
+		if (error <= tolerance || exact) {
+			return { threshold, samples, bytes, exact };
+		}
+
+		// The interval shrinks with the square root of the number of samples.
+		// Halving the stride doubles the samples, so reaching that many needs
+		// a last stride of about 2 * image_size / needed. Below one cache line
+		// every round reads the whole image again, so count it exactly instead.
+		double needed = samples * std::pow((double)error / std::max(tolerance, 1u), 2.0);
+		if (stride == 1 || needed * LinePixels >= 2.0 * image_size
+				|| bytes + strided_bytes<Pixel>(image_size, stride / 2) > budget) {
+			bytes += image_bytes;
+			return { counting_sort(greyscale, width, height, ratio), samples + image_size, bytes, true };
+		}
+
+		stride /= 2;
+		samples += histogram_jittered(greyscale, image_size, stride, random, count.get());
+		bytes += strided_bytes<Pixel>(image_size, stride);
 	}
-	return std::max((size_t)0, index - 1);
 }
 
 
-int main(int c, char* argv[]) {
-	int width, height, channels;
-	const char* greyscale_name = "sample_image.png";
-	const char* binary_name = "sample_binary.png";
-	Pixel* image;
-	Pixel* copy;
-	
-#if BIT_DEPTH <= 8
-	image = stbi_load(greyscale_name, &width, &height, &channels, GreyChannel);
+/**
+ * Binarize the pixels one at a time. Pixels above the cut become the max
+ * value and the rest become 0.
+ * @param greyscale - the pixels to binarize.
+ * @param binary - where to write the binary pixels (may be greyscale).
+ * @param size - the number of pixels.
+ * @param cut - the largest value that becomes 0.
+ */
+template <typename Pixel>
+void binarize_scalar(const Pixel* greyscale, Pixel* binary, size_t size, Pixel cut) {
+	for (size_t pixel = 0; pixel < size; pixel++) {
+		binary[pixel] = greyscale[pixel] > cut ? PixelTraits<Pixel>::Max : 0;
+	}
+}
+
+
+#if defined(HAS_SSE2)
+/**
+ * Mask of the 8-bit lanes greater than the cut, as max(pixel, cut + 1) is
+ * only the pixel itself when it is above the cut.
+ */
+inline __m128i greater_than(__m128i pixels, stbi_uc cut) {
+	__m128i above = _mm_set1_epi8((char)(cut + 1));
+	return _mm_cmpeq_epi8(_mm_max_epu8(pixels, above), pixels);
+}
+
+
+/**
+ * Mask of the 16-bit lanes greater than the cut, as the saturating
+ * subtraction of the cut is only zero when the pixel is not above it.
+ */
+inline __m128i greater_than(__m128i pixels, stbi_us cut) {
+	__m128i below = _mm_cmpeq_epi16(_mm_subs_epu16(pixels, _mm_set1_epi16((short)cut)), _mm_setzero_si128());
+	return _mm_xor_si128(below, _mm_set1_epi8((char)0xFF));
+}
+
+
+/**
+ * SSE2 binarize kernel. The comparison mask is already 0 or the max value in
+ * every lane, so it is stored directly. Stores are non-temporal, as the binary
+ * image is not read again until it is written out.
+ */
+template <typename Pixel>
+void binarize_sse2(const Pixel* greyscale, Pixel* binary, size_t size, Pixel cut) {
+	constexpr size_t VectorPixels = 16 / sizeof(Pixel);
+	size_t head = std::min(size, ((16 - (uintptr_t)binary % 16) % 16) / sizeof(Pixel));
+	binarize_scalar(greyscale, binary, head, cut);
+
+	size_t pixel = head;
+	for (; pixel + VectorPixels <= size; pixel += VectorPixels) {
+		__m128i vector = _mm_loadu_si128((const __m128i*)(greyscale + pixel));
+		_mm_stream_si128((__m128i*)(binary + pixel), greater_than(vector, cut));
+	}
+	_mm_sfence();
+	binarize_scalar(greyscale + pixel, binary + pixel, size - pixel, cut);
+}
+#endif
+
+
+/**
+ * Convert the image to black and white. Pixels above the threshold become
+ * white and pixels below it become black. Pixels equal to the threshold
+ * become black, unless they are already 0 or the max value, in which case
+ * they are left unchanged. That is the same as comparing every pixel against
+ * a single cut, which lets the comparison be vectorised. The image is split
+ * into bands of rows, one per thread.
+ * @param greyscale - the reference image.
+ * @param binary - where to write the binary image (may be greyscale).
+ * @param width - the width of the image.
+ * @param height - the height of the image.
+ * @param threshold - the threshold value.
+ * @param threads - the number of threads to split the image across.
+ */
+template <typename Pixel>
+void binarize(const Pixel* greyscale, Pixel* binary, int width, int height, Pixel threshold, unsigned int threads) {
+	// Only a max value pixel stays white when the threshold is the max value.
+	Pixel cut = threshold == PixelTraits<Pixel>::Max ? threshold - 1 : threshold;
+
+	parallel_for(height, threads, [&](unsigned int, size_t begin, size_t end) {
+		size_t offset = begin * width;
+		size_t size = (end - begin) * width;
+#if defined(HAS_SSE2)
+		binarize_sse2(greyscale + offset, binary + offset, size, cut);
 #else
-	image = stbi_load_16(greyscale_name, &width, &height, &channels, GreyChannel);
+		binarize_scalar(greyscale + offset, binary + offset, size, cut);
 #endif
-	assert(image != nullptr && "Failed to open image.");
-	copy = (Pixel*)malloc(sizeof(Pixel) * width * height);
-	if (copy == nullptr) return 1;
-	std::memcpy(copy, image, width * height);
+	});
+}
+
+
+/**
+ * A binary image packed one bit per pixel, with 1 for white and 0 for black.
+ * Each row is packed most significant bit first, the same as a 1-bit PNG, and
+ * padded out to a whole number of 64-bit words. Padding bits are always 0.
+ */
+struct Bitmap {
+	int width;
+	int height;
+	size_t stride; // Bytes per row, including padding.
+	std::vector<uint8_t> bits;
+
+	Bitmap(int width, int height)
+		: width(width), height(height), stride((width + 63) / 64 * 8), bits(stride * height) {}
+
+	uint8_t* row(int y) {
+		return bits.data() + y * stride;
+	}
+
+	const uint8_t* row(int y) const {
+		return bits.data() + y * stride;
+	}
+
+	/**
+	 * The number of white pixels, counted a word at a time.
+	 */
+	size_t count_white() const {
+		size_t white = 0;
+		for (size_t word = 0; word < bits.size(); word += 8) {
+			uint64_t value;
+			std::memcpy(&value, bits.data() + word, 8);
+			white += std::popcount(value);
+		}
+		return white;
+	}
+
+};
+
+
+/**
+ * Table that reverses the order of the bits in a byte, turning movemask
+ * order (first pixel in the lowest bit) into PNG order (first pixel in the
+ * highest bit).
+ */
+constexpr std::array<uint8_t, 256> ReverseBits = [] {
+	std::array<uint8_t, 256> table = {};
+	for (int value = 0; value < 256; value++) {
+		for (int bit = 0; bit < 8; bit++) {
+			if (value & (1 << bit)) table[value] |= 0x80 >> bit;
+		}
+	}
+	return table;
+}();
+
+
+/**
+ * Pack one row of pixels into bits, 1 where the pixel is above the cut. The
+ * SSE2 path compares 16 pixels at a time and turns the comparison into 16
+ * bits with movemask.
+ * @param pixels - the row of pixels.
+ * @param bits - where to write the bits, zeroed.
+ * @param width - the number of pixels in the row.
+ * @param cut - the largest value that becomes black.
+ */
+template <typename Pixel>
+void pack_row(const Pixel* pixels, uint8_t* bits, int width, Pixel cut) {
+	int x = 0;
+#if defined(HAS_SSE2)
+	for (; x + 16 <= width; x += 16) {
+		int mask;
+		if constexpr (PixelTraits<Pixel>::BitDepth <= 8) {
+			mask = _mm_movemask_epi8(greater_than(_mm_loadu_si128((const __m128i*)(pixels + x)), cut));
+		} else {
+			__m128i low = greater_than(_mm_loadu_si128((const __m128i*)(pixels + x)), cut);
+			__m128i high = greater_than(_mm_loadu_si128((const __m128i*)(pixels + x + 8)), cut);
+			mask = _mm_movemask_epi8(_mm_packs_epi16(low, high));
+		}
+		bits[x >> 3] = ReverseBits[mask & 0xFF];
+		bits[(x >> 3) + 1] = ReverseBits[mask >> 8];
+	}
+#endif
+	for (; x < width; x++) {
+		if (pixels[x] > cut) bits[x >> 3] |= 0x80 >> (x & 7);
+	}
+}
+
+
+/**
+ * Convert the image to a packed black and white bitmap, with the same rules
+ * as binarize. The image is split into bands of rows, one per thread.
+ * @param greyscale - the reference image.
+ * @param width - the width of the image.
+ * @param height - the height of the image.
+ * @param threshold - the threshold value.
+ * @param threads - the number of threads to split the image across.
+ */
+template <typename Pixel>
+Bitmap binarize_packed(const Pixel* greyscale, int width, int height, Pixel threshold, unsigned int threads) {
+	Bitmap bitmap(width, height);
+	Pixel cut = threshold == PixelTraits<Pixel>::Max ? threshold - 1 : threshold;
+
+	parallel_for(height, threads, [&](unsigned int, size_t begin, size_t end) {
+		for (size_t y = begin; y < end; y++) {
+			pack_row(greyscale + y * width, bitmap.row(y), width, cut);
+		}
+	});
+	return bitmap;
+}
+
+
+/**
+ * Benchmark every method on the image and export the binary image, using the
+ * versions of the threshold functions specialised for the pixel type.
+ * @param greyscale_name - the path of the image to threshold.
+ * @param binary_name - the path to write the binary image to.
+ */
+template <typename Pixel>
+int run(const char* greyscale_name, const char* binary_name) {
+	int width, height, channels;
+	Pixel* image;
+	unsigned int threads = std::max(1u, std::thread::hardware_concurrency());
 
 	/*
-	Benchmarking a few different methods. Methods that include a memcpy are
-	because they sort in place and therefore lose the original image.
+	Benchmarking a few different methods. Methods that sort in place work on
+	a copy of the image so that the original is kept for the export.
+
+		- Decode Histogram
+			Converts each row to grey and counts it while the PNG is being
+			decoded, so the threshold is known as soon as the image is loaded.
+			This is also how the image used by the other methods is loaded.
 
 		- Counting Sort
 			Using the frequency counting part of the counting sort to sort the
 			image pixels. Finds a cut off point and then counts to the
 			threshold.
 
+		- Histogram Query
+			Builds the cumulative histogram once and then looks up the
+			threshold for several ratios without reading the image again.
+
+		- Parallel Counting Sort
+			The counting sort with the image split across all hardware
+			threads, each counting into its own bins before they are merged.
+
 		- std::sort
 			Using the standard library sorting algorithm to sort the pixels and
 			then fetching the threshold from the sorted array.
@@ -224,6 +1818,10 @@ int main(int c, char* argv[]) {
 			Using the nth element algorithm from the algorithms module as a
 			faster version of the std::sort.
 
+		- Exact Select
+			Finds the same value as the sorting methods from a histogram (or a
+			radix select on wider pixels) without touching the image.
+
 		- Normal Distribution
 			Trying to estimate the threshold value using a normal distribution.
 			It's not very good.
@@ -235,6 +1833,19 @@ int main(int c, char* argv[]) {
 		- Uniform Sample
 			Looks at every n pixels rather than every pixel. Only good for
 			larger images or images with little detail.
+
+		- Block Sample
+			Like the uniform sample, but reads one whole cache line out of
+			every n so that less of the image is loaded from memory.
+
+		- Stratified Sample
+			Picks one random pixel from each cell of a grid over the image, so
+			that the samples do not all fall in the same few columns.
+
+		- Adaptive Sample
+			Keeps doubling the sample density until a confidence interval on
+			the threshold is within a tolerance, falling back to the counting
+			sort if that would take too many samples.
 	*/
 
 	// Benchmarking.
@@ -242,6 +1853,20 @@ int main(int c, char* argv[]) {
 	std::chrono::time_point<std::chrono::high_resolution_clock> end;
 	std::chrono::duration<float> duration;
 
+	// Decode Histogram.
+	std::unique_ptr<unsigned int[]> decode_count = std::make_unique<unsigned int[]>(PixelTraits<Pixel>::Bins);
+	start = std::chrono::high_resolution_clock::now();
+	if constexpr (PixelTraits<Pixel>::BitDepth <= 8) {
+		image = stbi_load_grey_histogram(greyscale_name, &width, &height, &channels, decode_count.get());
+	} else {
+		image = stbi_load_grey_histogram_16(greyscale_name, &width, &height, &channels, decode_count.get());
+	}
+	assert(image != nullptr && "Failed to open image.");
+	Pixel decode_histogram_threshold = Histogram<Pixel>(decode_count.get()).threshold(Ratio);
+	end = std::chrono::high_resolution_clock::now();
+	duration = end - start;
+	display("Decode Histogram", decode_histogram_threshold, duration.count());
+
 	// Counting Sort.
 	start = std::chrono::high_resolution_clock::now();
 	Pixel counting_sort_threshold = counting_sort(image, width, height, Ratio);
@@ -249,10 +1874,29 @@ int main(int c, char* argv[]) {
 	duration = end - start;
 	display("Counting Sort", counting_sort_threshold, duration.count());
 
+	// Histogram Query.
+	start = std::chrono::high_resolution_clock::now();
+	Histogram<Pixel> image_histogram = counting_histogram(image, width, height);
+	std::vector<Pixel> histogram_thresholds = image_histogram.thresholds(Ratios);
+	end = std::chrono::high_resolution_clock::now();
+	duration = end - start;
+	display("Histogram Query", image_histogram.threshold(Ratio), duration.count());
+	std::cout << Padding << "Thresholds:";
+	for (size_t index = 0; index < Ratios.size(); index++) {
+		std::cout << ' ' << std::setprecision(2) << Ratios[index] << '=' << (int)histogram_thresholds[index];
+	}
+	std::cout << std::endl;
+
+	// Parallel Counting Sort.
+	start = std::chrono::high_resolution_clock::now();
+	Pixel parallel_counting_sort_threshold = parallel_counting_sort(image, width, height, Ratio, threads);
+	end = std::chrono::high_resolution_clock::now();
+	duration = end - start;
+	display("Parallel Counting Sort", parallel_counting_sort_threshold, duration.count());
+
 	// std::sort.
 	start = std::chrono::high_resolution_clock::now();
 	Pixel std_sort_threshold = std_sort(image, width, height, Ratio);
-	std::memcpy(image, copy, width * height);
 	end = std::chrono::high_resolution_clock::now();
 	duration = end - start;
 	display("std::sort", std_sort_threshold, duration.count());
@@ -260,10 +1904,16 @@ int main(int c, char* argv[]) {
 	// Nth Element.
 	start = std::chrono::high_resolution_clock::now();
 	Pixel nth_element_sort_threshold = nth_element_sort(image, width, height, Ratio);
-	std::memcpy(image, copy, width * height);
 	end = std::chrono::high_resolution_clock::now();
 	duration = end - start;
 	display("Nth Element", nth_element_sort_threshold, duration.count());
+
+	// Exact Select.
+	start = std::chrono::high_resolution_clock::now();
+	Pixel exact_select_threshold = exact_select(image, width, height, Ratio);
+	end = std::chrono::high_resolution_clock::now();
+	duration = end - start;
+	display("Exact Select", exact_select_threshold, duration.count());
 	
 	// Normal Estimate.
 	start = std::chrono::high_resolution_clock::now();
@@ -284,19 +1934,74 @@ int main(int c, char* argv[]) {
 	Pixel uniform_sample_threshold = uniform_sample(image, width, height, SampleRate, Ratio);
 	end = std::chrono::high_resolution_clock::now();
 	duration = end - start;
-	display("Uniform Sample", uniform_sample_threshold, duration.count());
+	SampleResult<Pixel> uniform_sample_result = {
+		uniform_sample_threshold,
+		(width * height + SampleRate - 1) / SampleRate,
+		strided_bytes<Pixel>(width * height, SampleRate),
+		false
+	};
+	display("Uniform Sample", uniform_sample_result, width * height, duration.count());
+
+	// Block Sample.
+	start = std::chrono::high_resolution_clock::now();
+	SampleResult<Pixel> block_sample_result = block_sample(image, width, height, SampleRate, Ratio);
+	end = std::chrono::high_resolution_clock::now();
+	duration = end - start;
+	display("Block Sample", block_sample_result, width * height, duration.count());
+
+	// Stratified Sample.
+	start = std::chrono::high_resolution_clock::now();
+	SampleResult<Pixel> stratified_sample_result = stratified_sample(image, width, height, CellSize, Ratio, Seed);
+	end = std::chrono::high_resolution_clock::now();
+	duration = end - start;
+	display("Stratified Sample", stratified_sample_result, width * height, duration.count());
+
+	// Adaptive Sample. The tolerance is scaled up to the same fraction of a
+	// wider pixel's range.
+	unsigned int tolerance = Tolerance * (PixelTraits<Pixel>::Max + 1) / 256;
+	start = std::chrono::high_resolution_clock::now();
+	SampleResult<Pixel> adaptive_sample_result = adaptive_sample(image, width, height, Ratio, tolerance, Confidence, Seed);
+	end = std::chrono::high_resolution_clock::now();
+	duration = end - start;
+	display("Adaptive Sample", adaptive_sample_result, width * height, duration.count());
 	
-	// Export Pixel. Do not change pixels that are on the threshold if they are 0 or max BIT_DEPTH.
-	for (size_t pixel = 0; pixel < width * height; pixel++) {
-		if (image[pixel] > uniform_sample_threshold) {
-			image[pixel] = (1 << BIT_DEPTH) - 1;
-		} else if (image[pixel] < uniform_sample_threshold) {
-			image[pixel] = 0;
-		}
-		else if (!(image[pixel] == 0 || image[pixel] == ((1 << BIT_DEPTH) - 1))) {
-			image[pixel] = 0;
-		}
-	}
-	stbi_write_png(binary_name, width, height, 1, image, width * sizeof(Pixel));
+	// Packed Binarize.
+	start = std::chrono::high_resolution_clock::now();
+	Bitmap bitmap = binarize_packed(image, width, height, uniform_sample_threshold, threads);
+	end = std::chrono::high_resolution_clock::now();
+	duration = end - start;
+	display("Packed Binarize", uniform_sample_threshold, duration.count());
+	float black_ratio = 1.0f - (float)bitmap.count_white() / (width * height);
+	std::cout << Padding << "Black Ratio: " << std::setprecision(3) << black_ratio << std::endl;
+
+	// Byte Binarize. Timed only for comparison with the packed binarize; the
+	// export below writes the bitmap, so this result is not used. It runs
+	// after the packed binarize because it overwrites the image in place.
+	start = std::chrono::high_resolution_clock::now();
+	binarize(image, image, width, height, uniform_sample_threshold, threads);
+	end = std::chrono::high_resolution_clock::now();
+	duration = end - start;
+	display("Byte Binarize (benchmark only)", uniform_sample_threshold, duration.count());
+
+	// Export Pixel. The bitmap is already in 1-bit PNG layout, and only holds
+	// runs and repeated rows, so the bilevel compressor is enough.
+	stbi_write_png_compression_level = STBIW_ZLIB_BILEVEL;
+	start = std::chrono::high_resolution_clock::now();
+	stbi_write_png_1bit(binary_name, width, height, bitmap.bits.data(), (int)bitmap.stride);
+	end = std::chrono::high_resolution_clock::now();
+	duration = end - start;
+	display("Export", uniform_sample_threshold, duration.count());
 	return 0;
+}
+
+
+int main(int c, char* argv[]) {
+	const char* greyscale_name = c > 1 ? argv[1] : "sample_image.png";
+	const char* binary_name = c > 2 ? argv[2] : "sample_binary.png";
+
+	// Pick the pixel type from the image, so one binary handles both depths.
+	if (stbi_is_16_bit(greyscale_name)) {
+		return run<stbi_us>(greyscale_name, binary_name);
+	}
+	return run<stbi_uc>(greyscale_name, binary_name);
 }
\ No newline at end of file
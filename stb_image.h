@@ -258,8 +258,9 @@ RECENT REVISION HISTORY:
 // SIMD support
 //
 // The JPEG decoder will try to automatically use SIMD kernels on x86 when
-// supported by the compiler. For ARM Neon support, you must explicitly
-// request it.
+// supported by the compiler, as will PNG unfiltering and the RGB(A) to grey
+// and grey+alpha conversions used by desired_channels. For ARM Neon support,
+// you must explicitly request it (JPEG only).
 //
 // (The old do-it-yourself SIMD API is no longer supported in the current
 // code.)
@@ -325,6 +326,20 @@ RECENT REVISION HISTORY:
 //
 // ===========================================================================
 //
+// Greyscale histograms:
+//
+// stbi_load_grey_histogram() loads an image with desired_channels=1 and also
+// fills in the number of pixels with each grey value, 256 bins for the 8-bit
+// version and 65536 for stbi_load_grey_histogram_16(). For non-interlaced,
+// non-paletted PNGs of the matching bit depth the conversion and counting
+// are done on each row as it is unfiltered, so there is no separate pass over
+// the decoded image; anything else is counted after it has been loaded.
+//
+//     unsigned int histogram[256];
+//     stbi_uc *grey = stbi_load_grey_histogram(filename, &x, &y, &n, histogram);
+//
+// ===========================================================================
+//
 // ADDITIONAL CONFIGURATION
 //
 //  - You can suppress implementation of any of the decoders to reduce
@@ -366,6 +381,37 @@ RECENT REVISION HISTORY:
 //    huge block of memory and spend disproportionate time decoding it. By
 //    default this is set to (1 << 24), which is 16777216, but that's still
 //    very big.
+//
+//  - On POSIX systems you can #define STBI_MMAP to have stbi_load(),
+//    stbi_load_16() and the greyscale histogram loaders map the file instead
+//    of reading it through stdio. The PNG decoder then inflates IDAT data
+//    straight out of the mapping, as it does for stbi_load_from_memory().
+//    Files that can't be mapped fall back to stdio.
+//
+//  - #define STBI_FAST_ZLIB to use a faster inflate loop for PNG and
+//    stbi_zlib_decode_*(). It keeps a 64-bit bit buffer refilled 8 bytes at a
+//    time, decodes up to two literals per table lookup and copies matches 8 or
+//    16 bytes at a time. The output is the same as the stock decoder's, but it
+//    needs about 20KB more stack, and streams that are cut off before their
+//    final block may be rejected where the stock decoder let them through
+//    (or the other way round).
+//
+//  - Large non-interlaced PNGs can be decoded on two threads: the calling
+//    thread inflates and hands finished scanlines through a small ring to
+//    a second thread, which unfilters, converts and counts them while the
+//    inflate carries on. To enable it, #define all of
+//
+//        void *STBI_THREAD_START(void (*func)(void *), void *arg)
+//            run func(arg) on another thread and return a handle for it,
+//            or NULL to decode on the calling thread as usual
+//        void STBI_THREAD_JOIN(void *handle)
+//            wait for func to return
+//        unsigned int STBI_THREAD_WAIT(unsigned int *p, unsigned int old)
+//            block until *p != old and return it (an acquire load)
+//        void STBI_THREAD_STORE(unsigned int *p, unsigned int value)
+//            set *p (a release store) and wake any thread waiting on it
+//
+//    The output is the same either way.
 
 #ifndef STBI_NO_STDIO
 #include <stdio.h>
@@ -450,6 +496,16 @@ STBIDEF stbi_us *stbi_load_16          (char const *filename, int *x, int *y, in
 STBIDEF stbi_us *stbi_load_from_file_16(FILE *f, int *x, int *y, int *channels_in_file, int desired_channels);
 #endif
 
+////////////////////////////////////
+//
+// greyscale-with-histogram interface
+//
+
+#ifndef STBI_NO_STDIO
+STBIDEF stbi_uc *stbi_load_grey_histogram   (char const *filename, int *x, int *y, int *channels_in_file, unsigned int *histogram);
+STBIDEF stbi_us *stbi_load_grey_histogram_16(char const *filename, int *x, int *y, int *channels_in_file, unsigned int *histogram);
+#endif
+
 ////////////////////////////////////
 //
 // float-per-channel interface
@@ -598,6 +654,17 @@ STBIDEF int   stbi_zlib_decode_noheader_buffer(char *obuffer, int olen, const ch
 #include <stdio.h>
 #endif
 
+#if defined(STBI_MMAP) && (defined(STBI_NO_STDIO) || defined(_WIN32))
+#undef STBI_MMAP
+#endif
+
+#ifdef STBI_MMAP
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
 #ifndef STBI_ASSERT
 #include <assert.h>
 #define STBI_ASSERT(x) assert(x)
@@ -688,6 +755,12 @@ typedef unsigned char validate_uint32[sizeof(stbi__uint32)==4 ? 1 : -1];
 #define STBI_REALLOC_SIZED(p,oldsz,newsz) STBI_REALLOC(p,newsz)
 #endif
 
+#if defined(STBI_THREAD_START) && defined(STBI_THREAD_JOIN) && defined(STBI_THREAD_WAIT) && defined(STBI_THREAD_STORE)
+#define STBI__PNG_PIPELINE
+#elif defined(STBI_THREAD_START) || defined(STBI_THREAD_JOIN) || defined(STBI_THREAD_WAIT) || defined(STBI_THREAD_STORE)
+#error "Must define all or none of STBI_THREAD_START, STBI_THREAD_JOIN, STBI_THREAD_WAIT and STBI_THREAD_STORE."
+#endif
+
 // x86/x64 detection
 #if defined(__x86_64__) || defined(_M_X64)
 #define STBI__X64_TARGET
@@ -750,7 +823,7 @@ static int stbi__cpuid3(void)
 
 #define STBI_SIMD_ALIGN(type, name) __declspec(align(16)) type name
 
-#if !defined(STBI_NO_JPEG) && defined(STBI_SSE2)
+#if defined(STBI_SSE2) && !(defined(STBI_NO_JPEG) && defined(STBI_NO_PNG) && defined(STBI_NO_BMP) && defined(STBI_NO_PSD) && defined(STBI_NO_TGA) && defined(STBI_NO_GIF) && defined(STBI_NO_PIC) && defined(STBI_NO_PNM))
 static int stbi__sse2_available(void)
 {
    int info3 = stbi__cpuid3();
@@ -761,7 +834,7 @@ static int stbi__sse2_available(void)
 #else // assume GCC-style if not VC++
 #define STBI_SIMD_ALIGN(type, name) type name __attribute__((aligned(16)))
 
-#if !defined(STBI_NO_JPEG) && defined(STBI_SSE2)
+#if defined(STBI_SSE2) && !(defined(STBI_NO_JPEG) && defined(STBI_NO_PNG) && defined(STBI_NO_BMP) && defined(STBI_NO_PSD) && defined(STBI_NO_TGA) && defined(STBI_NO_GIF) && defined(STBI_NO_PIC) && defined(STBI_NO_PNM))
 static int stbi__sse2_available(void)
 {
    // If we're even attempting to compile this on GCC/Clang, that means
@@ -817,6 +890,10 @@ typedef struct
 
    stbi_uc *img_buffer, *img_buffer_end;
    stbi_uc *img_buffer_original, *img_buffer_original_end;
+
+   // greyscale loads can ask the loader to count pixels as it decodes them
+   stbi__uint32 *histogram;
+   int histogram_bits, histogram_counted;
 } stbi__context;
 
 
@@ -830,6 +907,8 @@ static void stbi__start_mem(stbi__context *s, stbi_uc const *buffer, int len)
    s->callback_already_read = 0;
    s->img_buffer = s->img_buffer_original = (stbi_uc *) buffer;
    s->img_buffer_end = s->img_buffer_original_end = (stbi_uc *) buffer+len;
+   s->histogram = NULL;
+   s->histogram_bits = s->histogram_counted = 0;
 }
 
 // initialize a callback-based context
@@ -841,6 +920,8 @@ static void stbi__start_callbacks(stbi__context *s, stbi_io_callbacks *c, void *
    s->read_from_callbacks = 1;
    s->callback_already_read = 0;
    s->img_buffer = s->img_buffer_original = s->buffer_start;
+   s->histogram = NULL;
+   s->histogram_bits = s->histogram_counted = 0;
    stbi__refill_buffer(s);
    s->img_buffer_original_end = s->img_buffer_end;
 }
@@ -1362,14 +1443,60 @@ static FILE *stbi__fopen(char const *filename, char const *mode)
    return f;
 }
 
+// an open image file; with STBI_MMAP the whole file is mapped and read like
+// a memory buffer, so nothing is staged through the context's IO buffer
+typedef struct
+{
+   FILE *f;
+   void *map;
+   size_t map_len;
+} stbi__file;
+
+static int stbi__open_file(stbi__context *s, stbi__file *file, char const *filename)
+{
+#ifdef STBI_MMAP
+   int fd = open(filename, O_RDONLY);
+   struct stat st;
+   file->map = NULL;
+   if (fd >= 0) {
+      // the memory loaders take an int length, so bigger files use stdio
+      if (fstat(fd, &st) == 0 && st.st_size > 0 && st.st_size <= INT_MAX) {
+         void *p = mmap(NULL, (size_t) st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+         if (p != MAP_FAILED) {
+            file->map = p;
+            file->map_len = (size_t) st.st_size;
+         }
+      }
+      close(fd);
+   }
+   if (file->map) {
+      file->f = NULL;
+      stbi__start_mem(s, (stbi_uc const *) file->map, (int) file->map_len);
+      return 1;
+   }
+#endif
+   file->f = stbi__fopen(filename, "rb");
+   if (!file->f) return 0;
+   stbi__start_file(s, file->f);
+   return 1;
+}
+
+static void stbi__close_file(stbi__file *file)
+{
+#ifdef STBI_MMAP
+   if (file->map) munmap(file->map, file->map_len);
+#endif
+   if (file->f) fclose(file->f);
+}
 
 STBIDEF stbi_uc *stbi_load(char const *filename, int *x, int *y, int *comp, int req_comp)
 {
-   FILE *f = stbi__fopen(filename, "rb");
+   stbi__file file;
+   stbi__context s;
    unsigned char *result;
-   if (!f) return stbi__errpuc("can't fopen", "Unable to open file");
-   result = stbi_load_from_file(f,x,y,comp,req_comp);
-   fclose(f);
+   if (!stbi__open_file(&s, &file, filename)) return stbi__errpuc("can't fopen", "Unable to open file");
+   result = stbi__load_and_postprocess_8bit(&s,x,y,comp,req_comp);
+   stbi__close_file(&file);
    return result;
 }
 
@@ -1401,11 +1528,51 @@ STBIDEF stbi__uint16 *stbi_load_from_file_16(FILE *f, int *x, int *y, int *comp,
 
 STBIDEF stbi_us *stbi_load_16(char const *filename, int *x, int *y, int *comp, int req_comp)
 {
-   FILE *f = stbi__fopen(filename, "rb");
+   stbi__file file;
+   stbi__context s;
    stbi__uint16 *result;
-   if (!f) return (stbi_us *) stbi__errpuc("can't fopen", "Unable to open file");
-   result = stbi_load_from_file_16(f,x,y,comp,req_comp);
-   fclose(f);
+   if (!stbi__open_file(&s, &file, filename)) return (stbi_us *) stbi__errpuc("can't fopen", "Unable to open file");
+   result = stbi__load_and_postprocess_16bit(&s,x,y,comp,req_comp);
+   stbi__close_file(&file);
+   return result;
+}
+
+STBIDEF stbi_uc *stbi_load_grey_histogram(char const *filename, int *x, int *y, int *comp, unsigned int *histogram)
+{
+   stbi__file file;
+   stbi_uc *result;
+   stbi__context s;
+   if (!stbi__open_file(&s, &file, filename)) return stbi__errpuc("can't fopen", "Unable to open file");
+   memset(histogram, 0, 256 * sizeof(*histogram));
+   s.histogram = histogram;
+   s.histogram_bits = 8;
+   result = stbi__load_and_postprocess_8bit(&s,x,y,comp,1);
+   stbi__close_file(&file);
+   // only the png loader counts as it goes, so count whatever it didn't
+   if (result && !s.histogram_counted) {
+      size_t i, n = (size_t) *x * *y;
+      for (i=0; i < n; ++i)
+         ++histogram[result[i]];
+   }
+   return result;
+}
+
+STBIDEF stbi_us *stbi_load_grey_histogram_16(char const *filename, int *x, int *y, int *comp, unsigned int *histogram)
+{
+   stbi__file file;
+   stbi__uint16 *result;
+   stbi__context s;
+   if (!stbi__open_file(&s, &file, filename)) return (stbi_us *) stbi__errpuc("can't fopen", "Unable to open file");
+   memset(histogram, 0, 65536 * sizeof(*histogram));
+   s.histogram = histogram;
+   s.histogram_bits = 16;
+   result = stbi__load_and_postprocess_16bit(&s,x,y,comp,1);
+   stbi__close_file(&file);
+   if (result && !s.histogram_counted) {
+      size_t i, n = (size_t) *x * *y;
+      for (i=0; i < n; ++i)
+         ++histogram[result[i]];
+   }
    return result;
 }
 
@@ -1752,9 +1919,130 @@ static stbi_uc stbi__compute_y(int r, int g, int b)
 #if defined(STBI_NO_PNG) && defined(STBI_NO_BMP) && defined(STBI_NO_PSD) && defined(STBI_NO_TGA) && defined(STBI_NO_GIF) && defined(STBI_NO_PIC) && defined(STBI_NO_PNM)
 // nothing
 #else
+#ifdef STBI_SSE2
+// luma of four pixels held one per 32-bit lane as r,g,b,x bytes, exactly as stbi__compute_y
+static __m128i stbi__compute_y_sse2(__m128i px)
+{
+   __m128i rb = _mm_and_si128(px, _mm_set1_epi16(0xff));
+   __m128i gx = _mm_srli_epi16(px, 8);
+   __m128i y  = _mm_add_epi32(_mm_madd_epi16(rb, _mm_set1_epi32(77 | (29 << 16))), _mm_madd_epi16(gx, _mm_set1_epi32(150)));
+   return _mm_srli_epi32(y, 8);
+}
+
+// spread four packed rgb pixels from the low 12 bytes into one 32-bit lane each
+static __m128i stbi__spread_rgb_sse2(__m128i v)
+{
+   __m128i p01 = _mm_unpacklo_epi32(v, _mm_srli_si128(v, 3));
+   __m128i p23 = _mm_unpacklo_epi32(_mm_srli_si128(v, 6), _mm_srli_si128(v, 9));
+   return _mm_unpacklo_epi64(p01, p23);
+}
+
+// pack two registers of 32-bit lanes holding 16-bit values, without signed saturation
+static __m128i stbi__pack32to16_sse2(__m128i a, __m128i b)
+{
+   a = _mm_srai_epi32(_mm_slli_epi32(a, 16), 16);
+   b = _mm_srai_epi32(_mm_slli_epi32(b, 16), 16);
+   return _mm_packs_epi32(a, b);
+}
+
+// the 3->1, 3->2, 4->1 and 4->2 conversions, 16 pixels at a time; returns how many
+// pixels were converted, leaving the rest to the scalar loop
+static unsigned int stbi__convert_row_sse2(unsigned char *dest, unsigned char *src, int img_n, int req_comp, unsigned int x)
+{
+   unsigned int i = 0;
+   int k;
+   __m128i px[4];
+
+   if ((img_n != 3 && img_n != 4) || req_comp > 2) return 0;
+
+   for (; i + 16 <= x; i += 16, src += 16*img_n, dest += 16*req_comp) {
+      if (img_n == 4) {
+         for (k=0; k < 4; ++k)
+            px[k] = _mm_loadu_si128((__m128i *) (src + 16*k));
+      } else {
+         __m128i v0 = _mm_loadu_si128((__m128i *) (src +  0));
+         __m128i v1 = _mm_loadu_si128((__m128i *) (src + 16));
+         __m128i v2 = _mm_loadu_si128((__m128i *) (src + 32));
+         px[0] = stbi__spread_rgb_sse2(v0);
+         px[1] = stbi__spread_rgb_sse2(_mm_or_si128(_mm_srli_si128(v0, 12), _mm_slli_si128(v1, 4)));
+         px[2] = stbi__spread_rgb_sse2(_mm_or_si128(_mm_srli_si128(v1,  8), _mm_slli_si128(v2, 8)));
+         px[3] = stbi__spread_rgb_sse2(_mm_srli_si128(v2, 4));
+      }
+      if (req_comp == 1) {
+         __m128i y01 = _mm_packs_epi32(stbi__compute_y_sse2(px[0]), stbi__compute_y_sse2(px[1]));
+         __m128i y23 = _mm_packs_epi32(stbi__compute_y_sse2(px[2]), stbi__compute_y_sse2(px[3]));
+         _mm_storeu_si128((__m128i *) dest, _mm_packus_epi16(y01, y23));
+      } else {
+         // alpha goes in the second byte of each 16-bit output, 255 if there is none
+         __m128i ya[4];
+         for (k=0; k < 4; ++k) {
+            __m128i alpha = img_n == 4 ? _mm_and_si128(_mm_srli_epi32(px[k], 16), _mm_set1_epi32(0xff00)) : _mm_set1_epi32(0xff00);
+            ya[k] = _mm_or_si128(stbi__compute_y_sse2(px[k]), alpha);
+         }
+         _mm_storeu_si128((__m128i *) (dest +  0), stbi__pack32to16_sse2(ya[0], ya[1]));
+         _mm_storeu_si128((__m128i *) (dest + 16), stbi__pack32to16_sse2(ya[2], ya[3]));
+      }
+   }
+   return i;
+}
+#endif
+
+// whether stbi__convert_row can use SSE2; looked up once per image rather than per row
+static int stbi__convert_simd(void)
+{
+#ifdef STBI_SSE2
+   return stbi__sse2_available();
+#else
+   return 0;
+#endif
+}
+
+// converts one scanline of x pixels, using SSE2 for the common cases if simd is set;
+// returns 0 if the conversion isn't supported
+static int stbi__convert_row(unsigned char *dest, unsigned char *src, int img_n, int req_comp, unsigned int x, int simd)
+{
+   int i;
+
+#ifdef STBI_SSE2
+   if (simd) {
+      unsigned int done = stbi__convert_row_sse2(dest, src, img_n, req_comp, x);
+      src += done*img_n;
+      dest += done*req_comp;
+      x -= done;
+   }
+#else
+   STBI_NOTUSED(simd);
+#endif
+
+   #define STBI__COMBO(a,b)  ((a)*8+(b))
+   #define STBI__CASE(a,b)   case STBI__COMBO(a,b): for(i=x-1; i >= 0; --i, src += a, dest += b)
+   // convert source image with img_n components to one with req_comp components;
+   // avoid switch per pixel, so use switch per scanline and massive macros
+   switch (STBI__COMBO(img_n, req_comp)) {
+      STBI__CASE(1,2) { dest[0]=src[0]; dest[1]=255;                                     } break;
+      STBI__CASE(1,3) { dest[0]=dest[1]=dest[2]=src[0];                                  } break;
+      STBI__CASE(1,4) { dest[0]=dest[1]=dest[2]=src[0]; dest[3]=255;                     } break;
+      STBI__CASE(2,1) { dest[0]=src[0];                                                  } break;
+      STBI__CASE(2,3) { dest[0]=dest[1]=dest[2]=src[0];                                  } break;
+      STBI__CASE(2,4) { dest[0]=dest[1]=dest[2]=src[0]; dest[3]=src[1];                  } break;
+      STBI__CASE(3,4) { dest[0]=src[0];dest[1]=src[1];dest[2]=src[2];dest[3]=255;        } break;
+      STBI__CASE(3,1) { dest[0]=stbi__compute_y(src[0],src[1],src[2]);                   } break;
+      STBI__CASE(3,2) { dest[0]=stbi__compute_y(src[0],src[1],src[2]); dest[1] = 255;    } break;
+      STBI__CASE(4,1) { dest[0]=stbi__compute_y(src[0],src[1],src[2]);                   } break;
+      STBI__CASE(4,2) { dest[0]=stbi__compute_y(src[0],src[1],src[2]); dest[1] = src[3]; } break;
+      STBI__CASE(4,3) { dest[0]=src[0];dest[1]=src[1];dest[2]=src[2];                    } break;
+      default:
+         if (img_n != req_comp) { STBI_ASSERT(0); return 0; }
+         memcpy(dest, src, (size_t) x * img_n);
+         break;
+   }
+   #undef STBI__CASE
+   return 1;
+}
+
 static unsigned char *stbi__convert_format(unsigned char *data, int img_n, int req_comp, unsigned int x, unsigned int y)
 {
-   int i,j;
+   int j, simd = stbi__convert_simd();
    unsigned char *good;
 
    if (req_comp == img_n) return data;
@@ -1769,27 +2057,9 @@ static unsigned char *stbi__convert_format(unsigned char *data, int img_n, int r
    for (j=0; j < (int) y; ++j) {
       unsigned char *src  = data + j * x * img_n   ;
       unsigned char *dest = good + j * x * req_comp;
-
-      #define STBI__COMBO(a,b)  ((a)*8+(b))
-      #define STBI__CASE(a,b)   case STBI__COMBO(a,b): for(i=x-1; i >= 0; --i, src += a, dest += b)
-      // convert source image with img_n components to one with req_comp components;
-      // avoid switch per pixel, so use switch per scanline and massive macros
-      switch (STBI__COMBO(img_n, req_comp)) {
-         STBI__CASE(1,2) { dest[0]=src[0]; dest[1]=255;                                     } break;
-         STBI__CASE(1,3) { dest[0]=dest[1]=dest[2]=src[0];                                  } break;
-         STBI__CASE(1,4) { dest[0]=dest[1]=dest[2]=src[0]; dest[3]=255;                     } break;
-         STBI__CASE(2,1) { dest[0]=src[0];                                                  } break;
-         STBI__CASE(2,3) { dest[0]=dest[1]=dest[2]=src[0];                                  } break;
-         STBI__CASE(2,4) { dest[0]=dest[1]=dest[2]=src[0]; dest[3]=src[1];                  } break;
-         STBI__CASE(3,4) { dest[0]=src[0];dest[1]=src[1];dest[2]=src[2];dest[3]=255;        } break;
-         STBI__CASE(3,1) { dest[0]=stbi__compute_y(src[0],src[1],src[2]);                   } break;
-         STBI__CASE(3,2) { dest[0]=stbi__compute_y(src[0],src[1],src[2]); dest[1] = 255;    } break;
-         STBI__CASE(4,1) { dest[0]=stbi__compute_y(src[0],src[1],src[2]);                   } break;
-         STBI__CASE(4,2) { dest[0]=stbi__compute_y(src[0],src[1],src[2]); dest[1] = src[3]; } break;
-         STBI__CASE(4,3) { dest[0]=src[0];dest[1]=src[1];dest[2]=src[2];                    } break;
-         default: STBI_ASSERT(0); STBI_FREE(data); STBI_FREE(good); return stbi__errpuc("unsupported", "Unsupported format conversion");
+      if (!stbi__convert_row(dest, src, img_n, req_comp, x, simd)) {
+         STBI_FREE(data); STBI_FREE(good); return stbi__errpuc("unsupported", "Unsupported format conversion");
       }
-      #undef STBI__CASE
    }
 
    STBI_FREE(data);
@@ -1809,9 +2079,116 @@ static stbi__uint16 stbi__compute_y_16(int r, int g, int b)
 #if defined(STBI_NO_PNG) && defined(STBI_NO_PSD)
 // nothing
 #else
+#ifdef STBI_SSE2
+// luma of eight 16-bit pixels from their channels, exactly as stbi__compute_y_16
+static __m128i stbi__compute_y16_sse2(__m128i r, __m128i g, __m128i b)
+{
+   __m128i wr = _mm_set1_epi16(77), wg = _mm_set1_epi16(150), wb = _mm_set1_epi16(29);
+   __m128i rl = _mm_mullo_epi16(r, wr), rh = _mm_mulhi_epu16(r, wr);
+   __m128i gl = _mm_mullo_epi16(g, wg), gh = _mm_mulhi_epu16(g, wg);
+   __m128i bl = _mm_mullo_epi16(b, wb), bh = _mm_mulhi_epu16(b, wb);
+   __m128i lo = _mm_add_epi32(_mm_add_epi32(_mm_unpacklo_epi16(rl, rh), _mm_unpacklo_epi16(gl, gh)), _mm_unpacklo_epi16(bl, bh));
+   __m128i hi = _mm_add_epi32(_mm_add_epi32(_mm_unpackhi_epi16(rl, rh), _mm_unpackhi_epi16(gl, gh)), _mm_unpackhi_epi16(bl, bh));
+   return stbi__pack32to16_sse2(_mm_srli_epi32(lo, 8), _mm_srli_epi32(hi, 8));
+}
+
+// the 16-bit versions of the conversions in stbi__convert_row_sse2, 8 pixels at a time
+static unsigned int stbi__convert_row16_sse2(stbi__uint16 *dest, stbi__uint16 *src, int img_n, int req_comp, unsigned int x)
+{
+   unsigned int i = 0;
+   __m128i px[4];
+
+   if ((img_n != 3 && img_n != 4) || req_comp > 2) return 0;
+
+   for (; i + 8 <= x; i += 8, src += 8*img_n, dest += 8*req_comp) {
+      __m128i t0, t1, t2, t3, u0, u1, u2, u3, r, g, b, y;
+      // gather two pixels per register, four channels each
+      if (img_n == 4) {
+         px[0] = _mm_loadu_si128((__m128i *) (src +  0));
+         px[1] = _mm_loadu_si128((__m128i *) (src +  8));
+         px[2] = _mm_loadu_si128((__m128i *) (src + 16));
+         px[3] = _mm_loadu_si128((__m128i *) (src + 24));
+      } else {
+         __m128i v0 = _mm_loadu_si128((__m128i *) (src +  0));
+         __m128i v1 = _mm_loadu_si128((__m128i *) (src +  8));
+         __m128i v2 = _mm_loadu_si128((__m128i *) (src + 16));
+         __m128i v01 = _mm_or_si128(_mm_srli_si128(v0, 12), _mm_slli_si128(v1, 4));
+         __m128i v12 = _mm_or_si128(_mm_srli_si128(v1,  8), _mm_slli_si128(v2, 8));
+         __m128i v22 = _mm_srli_si128(v2, 4);
+         px[0] = _mm_unpacklo_epi64(v0,  _mm_srli_si128(v0,  6));
+         px[1] = _mm_unpacklo_epi64(v01, _mm_srli_si128(v01, 6));
+         px[2] = _mm_unpacklo_epi64(v12, _mm_srli_si128(v12, 6));
+         px[3] = _mm_unpacklo_epi64(v22, _mm_srli_si128(v22, 6));
+      }
+      // transpose to one register per channel
+      t0 = _mm_unpacklo_epi16(px[0], px[1]);
+      t1 = _mm_unpackhi_epi16(px[0], px[1]);
+      t2 = _mm_unpacklo_epi16(px[2], px[3]);
+      t3 = _mm_unpackhi_epi16(px[2], px[3]);
+      u0 = _mm_unpacklo_epi16(t0, t1);
+      u1 = _mm_unpackhi_epi16(t0, t1);
+      u2 = _mm_unpacklo_epi16(t2, t3);
+      u3 = _mm_unpackhi_epi16(t2, t3);
+      r = _mm_unpacklo_epi64(u0, u2);
+      g = _mm_unpackhi_epi64(u0, u2);
+      b = _mm_unpacklo_epi64(u1, u3);
+      y = stbi__compute_y16_sse2(r, g, b);
+      if (req_comp == 1) {
+         _mm_storeu_si128((__m128i *) dest, y);
+      } else {
+         __m128i a = img_n == 4 ? _mm_unpackhi_epi64(u1, u3) : _mm_set1_epi16(-1);
+         _mm_storeu_si128((__m128i *) (dest + 0), _mm_unpacklo_epi16(y, a));
+         _mm_storeu_si128((__m128i *) (dest + 8), _mm_unpackhi_epi16(y, a));
+      }
+   }
+   return i;
+}
+#endif
+
+static int stbi__convert_row16(stbi__uint16 *dest, stbi__uint16 *src, int img_n, int req_comp, unsigned int x, int simd)
+{
+   int i;
+
+#ifdef STBI_SSE2
+   if (simd) {
+      unsigned int done = stbi__convert_row16_sse2(dest, src, img_n, req_comp, x);
+      src += done*img_n;
+      dest += done*req_comp;
+      x -= done;
+   }
+#else
+   STBI_NOTUSED(simd);
+#endif
+
+   #define STBI__COMBO(a,b)  ((a)*8+(b))
+   #define STBI__CASE(a,b)   case STBI__COMBO(a,b): for(i=x-1; i >= 0; --i, src += a, dest += b)
+   // convert source image with img_n components to one with req_comp components;
+   // avoid switch per pixel, so use switch per scanline and massive macros
+   switch (STBI__COMBO(img_n, req_comp)) {
+      STBI__CASE(1,2) { dest[0]=src[0]; dest[1]=0xffff;                                     } break;
+      STBI__CASE(1,3) { dest[0]=dest[1]=dest[2]=src[0];                                     } break;
+      STBI__CASE(1,4) { dest[0]=dest[1]=dest[2]=src[0]; dest[3]=0xffff;                     } break;
+      STBI__CASE(2,1) { dest[0]=src[0];                                                     } break;
+      STBI__CASE(2,3) { dest[0]=dest[1]=dest[2]=src[0];                                     } break;
+      STBI__CASE(2,4) { dest[0]=dest[1]=dest[2]=src[0]; dest[3]=src[1];                     } break;
+      STBI__CASE(3,4) { dest[0]=src[0];dest[1]=src[1];dest[2]=src[2];dest[3]=0xffff;        } break;
+      STBI__CASE(3,1) { dest[0]=stbi__compute_y_16(src[0],src[1],src[2]);                   } break;
+      STBI__CASE(3,2) { dest[0]=stbi__compute_y_16(src[0],src[1],src[2]); dest[1] = 0xffff; } break;
+      STBI__CASE(4,1) { dest[0]=stbi__compute_y_16(src[0],src[1],src[2]);                   } break;
+      STBI__CASE(4,2) { dest[0]=stbi__compute_y_16(src[0],src[1],src[2]); dest[1] = src[3]; } break;
+      STBI__CASE(4,3) { dest[0]=src[0];dest[1]=src[1];dest[2]=src[2];                       } break;
+      default:
+         if (img_n != req_comp) { STBI_ASSERT(0); return 0; }
+         memcpy(dest, src, (size_t) x * img_n * 2);
+         break;
+   }
+   #undef STBI__CASE
+   return 1;
+}
+
 static stbi__uint16 *stbi__convert_format16(stbi__uint16 *data, int img_n, int req_comp, unsigned int x, unsigned int y)
 {
-   int i,j;
+   int j, simd = stbi__convert_simd();
    stbi__uint16 *good;
 
    if (req_comp == img_n) return data;
@@ -1826,27 +2203,9 @@ static stbi__uint16 *stbi__convert_format16(stbi__uint16 *data, int img_n, int r
    for (j=0; j < (int) y; ++j) {
       stbi__uint16 *src  = data + j * x * img_n   ;
       stbi__uint16 *dest = good + j * x * req_comp;
-
-      #define STBI__COMBO(a,b)  ((a)*8+(b))
-      #define STBI__CASE(a,b)   case STBI__COMBO(a,b): for(i=x-1; i >= 0; --i, src += a, dest += b)
-      // convert source image with img_n components to one with req_comp components;
-      // avoid switch per pixel, so use switch per scanline and massive macros
-      switch (STBI__COMBO(img_n, req_comp)) {
-         STBI__CASE(1,2) { dest[0]=src[0]; dest[1]=0xffff;                                     } break;
-         STBI__CASE(1,3) { dest[0]=dest[1]=dest[2]=src[0];                                     } break;
-         STBI__CASE(1,4) { dest[0]=dest[1]=dest[2]=src[0]; dest[3]=0xffff;                     } break;
-         STBI__CASE(2,1) { dest[0]=src[0];                                                     } break;
-         STBI__CASE(2,3) { dest[0]=dest[1]=dest[2]=src[0];                                     } break;
-         STBI__CASE(2,4) { dest[0]=dest[1]=dest[2]=src[0]; dest[3]=src[1];                     } break;
-         STBI__CASE(3,4) { dest[0]=src[0];dest[1]=src[1];dest[2]=src[2];dest[3]=0xffff;        } break;
-         STBI__CASE(3,1) { dest[0]=stbi__compute_y_16(src[0],src[1],src[2]);                   } break;
-         STBI__CASE(3,2) { dest[0]=stbi__compute_y_16(src[0],src[1],src[2]); dest[1] = 0xffff; } break;
-         STBI__CASE(4,1) { dest[0]=stbi__compute_y_16(src[0],src[1],src[2]);                   } break;
-         STBI__CASE(4,2) { dest[0]=stbi__compute_y_16(src[0],src[1],src[2]); dest[1] = src[3]; } break;
-         STBI__CASE(4,3) { dest[0]=src[0];dest[1]=src[1];dest[2]=src[2];                       } break;
-         default: STBI_ASSERT(0); STBI_FREE(data); STBI_FREE(good); return (stbi__uint16*) stbi__errpuc("unsupported", "Unsupported format conversion");
+      if (!stbi__convert_row16(dest, src, img_n, req_comp, x, simd)) {
+         STBI_FREE(data); STBI_FREE(good); return (stbi__uint16*) stbi__errpuc("unsupported", "Unsupported format conversion");
       }
-      #undef STBI__CASE
    }
 
    STBI_FREE(data);
@@ -4092,6 +4451,11 @@ static int stbi__jpeg_info(stbi__context *s, int *x, int *y, int *comp)
 #define STBI__ZFAST_MASK  ((1 << STBI__ZFAST_BITS) - 1)
 #define STBI__ZNSYMS 288 // number of symbols in literal/length alphabet
 
+#ifdef STBI_FAST_ZLIB
+#define STBI__ZWIDE_BITS   12 // literal/length lookup, wide enough to hold most pairs of literals
+#define STBI__ZWIDE_DBITS  10 // distance lookup
+#endif
+
 // zlib-style huffman encoding
 // (jpegs packs from left, zlib from right, so can't share code)
 typedef struct
@@ -4186,12 +4550,36 @@ typedef struct
    char *zout_end;
    int   z_expandable;
 
+   // if flush is set, output before zout_done has been handed to it, and only as much
+   // as back references can reach is kept when the buffer fills instead of growing it
+   char *zout_done;
+   int (*flush)(void *user, stbi_uc *data, int len); // returns bytes consumed, or -1 on error
+   void *flush_user;
+
+   // if refill is set, it is asked for the next piece of input whenever zbuffer runs
+   // out, so the compressed stream doesn't have to be in one buffer
+   int (*refill)(void *user, stbi_uc **start, stbi_uc **end); // returns 0 at the end
+   void *refill_user;
+
    stbi__zhuffman z_length, z_distance;
+#ifdef STBI_FAST_ZLIB
+   stbi__uint32 wide_length[1 << STBI__ZWIDE_BITS];
+   stbi__uint32 wide_distance[1 << STBI__ZWIDE_DBITS];
+#endif
 } stbi__zbuf;
 
+static int stbi__zrefill(stbi__zbuf *z)
+{
+   while (z->zbuffer >= z->zbuffer_end)
+      if (!z->refill(z->refill_user, &z->zbuffer, &z->zbuffer_end))
+         return 0;
+   return 1;
+}
+
 stbi_inline static int stbi__zeof(stbi__zbuf *z)
 {
-   return (z->zbuffer >= z->zbuffer_end);
+   if (z->zbuffer < z->zbuffer_end) return 0;
+   return !z->refill || !stbi__zrefill(z);
 }
 
 stbi_inline static stbi_uc stbi__zget8(stbi__zbuf *z)
@@ -4204,6 +4592,7 @@ static void stbi__fill_bits(stbi__zbuf *z)
    do {
       if (z->code_buffer >= (1U << z->num_bits)) {
         z->zbuffer = z->zbuffer_end;  /* treat this as EOF so we fail. */
+        z->refill = NULL;
         return;
       }
       z->code_buffer |= (unsigned int) stbi__zget8(z) << z->num_bits;
@@ -4270,11 +4659,33 @@ stbi_inline static int stbi__zhuffman_decode(stbi__zbuf *a, stbi__zhuffman *z)
    return stbi__zhuffman_decode_slowpath(a, z);
 }
 
+// hand the finished output to the flush callback, then slide the window down
+static int stbi__zflush(stbi__zbuf *z)
+{
+   char *keep;
+   int used = z->flush(z->flush_user, (stbi_uc *) z->zout_done, (int) (z->zout - z->zout_done));
+   if (used < 0) return 0;
+   z->zout_done += used;
+   keep = (z->zout - z->zout_start > 32768) ? z->zout - 32768 : z->zout_start;
+   if (keep > z->zout_done) keep = z->zout_done;
+   if (keep > z->zout_start) {
+      int shift = (int) (keep - z->zout_start);
+      memmove(z->zout_start, keep, z->zout - keep);
+      z->zout -= shift;
+      z->zout_done -= shift;
+   }
+   return 1;
+}
+
 static int stbi__zexpand(stbi__zbuf *z, char *zout, int n)  // need to make room for n bytes
 {
    char *q;
    unsigned int cur, limit, old_limit;
    z->zout = zout;
+   if (z->flush) {
+      if (!stbi__zflush(z)) return 0;
+      if (z->zout_end - z->zout >= n) return 1;
+   }
    if (!z->z_expandable) return stbi__err("output buffer limit","Corrupt PNG");
    cur   = (unsigned int) (z->zout - z->zout_start);
    limit = old_limit = (unsigned) (z->zout_end - z->zout_start);
@@ -4286,6 +4697,7 @@ static int stbi__zexpand(stbi__zbuf *z, char *zout, int n)  // need to make room
    q = (char *) STBI_REALLOC_SIZED(z->zout_start, old_limit, limit);
    STBI_NOTUSED(old_limit);
    if (q == NULL) return stbi__err("outofmem", "Out of memory");
+   z->zout_done  = q + (z->zout_done - z->zout_start);
    z->zout_start = q;
    z->zout       = q + cur;
    z->zout_end   = q + limit;
@@ -4306,11 +4718,239 @@ static const int stbi__zdist_base[32] = { 1,2,3,4,5,7,9,13,17,25,33,49,65,97,129
 static const int stbi__zdist_extra[32] =
 { 0,0,0,0,1,1,2,2,3,3,4,4,5,5,6,6,7,7,8,8,9,9,10,10,11,11,12,12,13,13};
 
+#ifdef STBI_FAST_ZLIB
+// Faster inflate for the bulk of a huffman block: the bit buffer is 64 bits and
+// refilled 8 bytes at a time, the literal/length lookup can return two literals
+// at once, and matches are copied 8 or 16 bytes at a time. It only runs while
+// there are at least 8 bytes of input and STBI__ZWIDE_SLACK bytes of output left,
+// so none of that needs bounds checks; the stock decoder handles the rest.
+
+#if defined(_MSC_VER)
+typedef unsigned __int64 stbi__zbits;
+#else
+typedef uint64_t stbi__zbits;
+#endif
+
+#define STBI__ZWIDE_SLACK   (258+16) // longest match plus the overshoot of wide copies
+
+// lookup entries: bits 0-3 are the number of bits to consume, bits 4-6 the kind
+// and the rest the payload (literals, or base and extra bits); 0 = not in table
+enum
+{
+   STBI__ZWIDE_literal=1,  // payload: literal
+   STBI__ZWIDE_literal2,   // payload: first literal | second literal << 8
+   STBI__ZWIDE_length,     // payload: base length | extra bits << 9
+   STBI__ZWIDE_end         // end of block
+};
+
+stbi_inline static stbi__zbits stbi__zload64(const stbi_uc *p)
+{
+#if defined(STBI__X64_TARGET) || defined(STBI__X86_TARGET) || (defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__)
+   stbi__zbits v;
+   memcpy(&v, p, 8);
+   return v;
+#else
+   stbi__zbits v = 0;
+   int i;
+   for (i=7; i >= 0; --i)
+      v = (v << 8) | p[i];
+   return v;
+#endif
+}
+
+// symbols 286 and up are invalid and get no entry, so they go to the slow path
+static stbi__uint32 stbi__zwide_length_entry(int sym, int s)
+{
+   if (sym < 256) return (stbi__uint32) (sym << 8) | (STBI__ZWIDE_literal << 4) | s;
+   if (sym == 256) return (STBI__ZWIDE_end << 4) | s;
+   if (sym >= 286) return 0;
+   sym -= 257;
+   return (stbi__uint32) ((stbi__zlength_base[sym] | stbi__zlength_extra[sym] << 9) << 8) | (STBI__ZWIDE_length << 4) | s;
+}
+
+// bits 0-3 are the code length, bits 4-7 the extra bits and the rest the base
+static stbi__uint32 stbi__zwide_distance_entry(int sym, int s)
+{
+   if (sym >= 30) return 0;
+   return (stbi__uint32) (stbi__zdist_base[sym] << 8) | (stbi__zdist_extra[sym] << 4) | s;
+}
+
+// fills table with (symbol << 8 | code length) for every code of up to bits bits;
+// sizelist has already been validated by stbi__zbuild_huffman
+static void stbi__zwide_codes(stbi__uint32 *table, int bits, const stbi_uc *sizelist, int num)
+{
+   int i, code = 0, next_code[16], sizes[16];
+   memset(sizes, 0, sizeof(sizes));
+   memset(table, 0, sizeof(*table) << bits);
+   for (i=0; i < num; ++i)
+      ++sizes[sizelist[i]];
+   sizes[0] = 0;
+   for (i=1; i < 16; ++i) {
+      next_code[i] = code;
+      code = (code + sizes[i]) << 1;
+   }
+   for (i=0; i < num; ++i) {
+      int s = sizelist[i];
+      if (s && s <= bits) {
+         int j = stbi__bit_reverse(next_code[s], s);
+         while (j < (1 << bits)) {
+            table[j] = (stbi__uint32) (i << 8) | s;
+            j += (1 << s);
+         }
+      }
+      if (s) ++next_code[s];
+   }
+}
+
+static void stbi__zbuild_wide(stbi__zbuf *a, const stbi_uc *lengths, int nlength, const stbi_uc *distances, int ndistance)
+{
+   stbi__uint32 *t = a->wide_length;
+   int j;
+   stbi__zwide_codes(t, STBI__ZWIDE_BITS, lengths, nlength);
+   // go downwards, so that t[j >> s] (which is never above j) is still unconverted
+   for (j=(1 << STBI__ZWIDE_BITS)-1; j >= 0; --j) {
+      stbi__uint32 e = t[j], e2;
+      int s, sym;
+      if (!e) continue;
+      s = e & 255;
+      sym = e >> 8;
+      e2 = t[j >> s];
+      if (sym < 256 && e2 && (int) (e2 >> 8) < 256 && s + (int) (e2 & 255) <= STBI__ZWIDE_BITS)
+         t[j] = (stbi__uint32) ((sym | (e2 >> 8) << 8) << 8) | (STBI__ZWIDE_literal2 << 4) | (s + (e2 & 255));
+      else
+         t[j] = stbi__zwide_length_entry(sym, s);
+   }
+   t = a->wide_distance;
+   stbi__zwide_codes(t, STBI__ZWIDE_DBITS, distances, ndistance);
+   for (j=0; j < (1 << STBI__ZWIDE_DBITS); ++j)
+      if (t[j])
+         t[j] = stbi__zwide_distance_entry(t[j] >> 8, t[j] & 255);
+}
+
+// canonical decode of the low 16 bits, for codes longer than the lookup tables
+static int stbi__zhuffman_decode_bits(stbi__zhuffman *z, unsigned int bits, int *size)
+{
+   int b,s,k;
+   k = stbi__bit_reverse(bits & 0xffff, 16);
+   for (s=1; s < 16; ++s)
+      if (k < z->maxcode[s])
+         break;
+   if (s >= 16) return -1;
+   b = (k >> (16-s)) - z->firstcode[s] + z->firstsymbol[s];
+   if (b >= STBI__ZNSYMS || z->size[b] != s) return -1;
+   *size = s;
+   return z->value[b];
+}
+
+// returns 1 at the end of the block, 2 when it gets too close to the end of the
+// input or output, and 0 on corrupt data
+static int stbi__parse_huffman_wide(stbi__zbuf *a, char **pzout)
+{
+   const stbi_uc *in = a->zbuffer, *in_start = a->zbuffer, *in_end = a->zbuffer_end;
+   char *zout = *pzout, *zout_end = a->zout_end;
+   stbi__zbits bits = a->code_buffer;
+   int nbits = a->num_bits, result;
+   for(;;) {
+      stbi__uint32 e;
+      int kind, len, dist, extra;
+      if (in_end - in < 8 || zout_end - zout < STBI__ZWIDE_SLACK) { result = 2; break; }
+      // top up to at least 56 bits; bits above nbits are the bytes at in, so
+      // or'ing them in again on the next refill doesn't change them
+      bits |= stbi__zload64(in) << nbits;
+      in += (63 - nbits) >> 3;
+      nbits |= 56;
+
+      e = a->wide_length[bits & ((1 << STBI__ZWIDE_BITS) - 1)];
+      if (!e) {
+         int s, sym = stbi__zhuffman_decode_bits(&a->z_length, (unsigned int) bits, &s);
+         if (sym < 0 || !(e = stbi__zwide_length_entry(sym, s))) { result = stbi__err("bad huffman code","Corrupt PNG"); break; }
+      }
+      bits >>= e & 15;
+      nbits -= e & 15;
+      kind = (e >> 4) & 7;
+      if (kind == STBI__ZWIDE_literal) {
+         *zout++ = (char) (e >> 8);
+         continue;
+      }
+      if (kind == STBI__ZWIDE_literal2) {
+         zout[0] = (char) (e >> 8);
+         zout[1] = (char) (e >> 16);
+         zout += 2;
+         continue;
+      }
+      if (kind == STBI__ZWIDE_end) { result = 1; break; }
+
+      // length, then distance; together at most 15+5+15+13 = 48 bits
+      extra = e >> 17;
+      len = ((e >> 8) & 511) + (int) (bits & ((1u << extra) - 1));
+      bits >>= extra;
+      nbits -= extra;
+      e = a->wide_distance[bits & ((1 << STBI__ZWIDE_DBITS) - 1)];
+      if (!e) {
+         int s, sym = stbi__zhuffman_decode_bits(&a->z_distance, (unsigned int) bits, &s);
+         if (sym < 0 || !(e = stbi__zwide_distance_entry(sym, s))) { result = stbi__err("bad huffman code","Corrupt PNG"); break; }
+      }
+      bits >>= e & 15;
+      nbits -= e & 15;
+      extra = (e >> 4) & 15;
+      dist = (int) (e >> 8) + (int) (bits & ((1u << extra) - 1));
+      bits >>= extra;
+      nbits -= extra;
+      if (zout - a->zout_start < dist) { result = stbi__err("bad dist","Corrupt PNG"); break; }
+
+      {
+         char *src = zout - dist, *end = zout + len;
+         if (dist >= 16) {
+            do { memcpy(zout, src, 16); zout += 16; src += 16; } while (zout < end);
+         } else if (dist >= 8) {
+            do { memcpy(zout, src, 8); zout += 8; src += 8; } while (zout < end);
+         } else if (dist == 1) {
+            memset(zout, *src, len);
+         } else {
+            // lay down the pattern until it reaches back a multiple of dist that's at
+            // least 8, then copy from that far back; it repeats the same bytes
+            int step = (8 + dist - 1) / dist * dist;
+            char *stop = zout + (step - dist);
+            if (stop > end) stop = end;
+            while (zout < stop) *zout++ = *src++;
+            src = zout - step;
+            while (zout < end) { memcpy(zout, src, 8); zout += 8; src += 8; }
+         }
+         zout = end;
+      }
+   }
+
+   // hand back whole bytes that were read ahead, so the stock decoder can carry
+   // on with at most 32 bits buffered; the newest bits all came from [in_start,in)
+   {
+      int back = nbits >> 3;
+      if (back > (int) (in - in_start)) back = (int) (in - in_start);
+      in -= back;
+      nbits -= back * 8;
+   }
+   a->zbuffer = (stbi_uc *) in;
+   a->code_buffer = (stbi__uint32) (bits & ((((stbi__zbits) 1) << nbits) - 1));
+   a->num_bits = nbits;
+   *pzout = zout;
+   return result;
+}
+#endif // STBI_FAST_ZLIB
+
 static int stbi__parse_huffman_block(stbi__zbuf *a)
 {
    char *zout = a->zout;
    for(;;) {
-      int z = stbi__zhuffman_decode(a, &a->z_length);
+      int z;
+#ifdef STBI_FAST_ZLIB
+      if (!a->hit_zeof_once) {
+         int r = stbi__parse_huffman_wide(a, &zout);
+         if (r != 2) {
+            a->zout = zout;
+            return r;
+         }
+      }
+#endif
+      z = stbi__zhuffman_decode(a, &a->z_length);
       if (z < 256) {
          if (z < 0) return stbi__err("bad huffman code","Corrupt PNG"); // error in huffman codes
          if (zout >= a->zout_end) {
@@ -4403,6 +5043,9 @@ static int stbi__compute_huffman_codes(stbi__zbuf *a)
    if (n != ntot) return stbi__err("bad codelengths","Corrupt PNG");
    if (!stbi__zbuild_huffman(&a->z_length, lencodes, hlit)) return 0;
    if (!stbi__zbuild_huffman(&a->z_distance, lencodes+hlit, hdist)) return 0;
+#ifdef STBI_FAST_ZLIB
+   stbi__zbuild_wide(a, lencodes, hlit, lencodes+hlit, hdist);
+#endif
    return 1;
 }
 
@@ -4426,12 +5069,19 @@ static int stbi__parse_uncompressed_block(stbi__zbuf *a)
    len  = header[1] * 256 + header[0];
    nlen = header[3] * 256 + header[2];
    if (nlen != (len ^ 0xffff)) return stbi__err("zlib corrupt","Corrupt PNG");
-   if (a->zbuffer + len > a->zbuffer_end) return stbi__err("read past buffer","Corrupt PNG");
+   if (!a->refill && a->zbuffer + len > a->zbuffer_end) return stbi__err("read past buffer","Corrupt PNG");
    if (a->zout + len > a->zout_end)
       if (!stbi__zexpand(a, a->zout, len)) return 0;
-   memcpy(a->zout, a->zbuffer, len);
-   a->zbuffer += len;
-   a->zout += len;
+   // the block may span several pieces of input
+   while (len > 0) {
+      if (stbi__zeof(a)) return stbi__err("read past buffer","Corrupt PNG");
+      k = (int) (a->zbuffer_end - a->zbuffer);
+      if (k > len) k = len;
+      memcpy(a->zout, a->zbuffer, k);
+      a->zbuffer += k;
+      a->zout += k;
+      len -= k;
+   }
    return 1;
 }
 
@@ -4498,6 +5148,9 @@ static int stbi__parse_zlib(stbi__zbuf *a, int parse_header)
             // use fixed code lengths
             if (!stbi__zbuild_huffman(&a->z_length  , stbi__zdefault_length  , STBI__ZNSYMS)) return 0;
             if (!stbi__zbuild_huffman(&a->z_distance, stbi__zdefault_distance,  32)) return 0;
+#ifdef STBI_FAST_ZLIB
+            stbi__zbuild_wide(a, stbi__zdefault_length, STBI__ZNSYMS, stbi__zdefault_distance, 32);
+#endif
          } else {
             if (!stbi__compute_huffman_codes(a)) return 0;
          }
@@ -4513,6 +5166,23 @@ static int stbi__do_zlib(stbi__zbuf *a, char *obuf, int olen, int exp, int parse
    a->zout       = obuf;
    a->zout_end   = obuf + olen;
    a->z_expandable = exp;
+   a->zout_done  = obuf;
+   a->flush      = NULL;
+   a->refill     = NULL;
+
+   return stbi__parse_zlib(a, parse_header);
+}
+
+// as stbi__do_zlib, for callers that have set up their own flush and refill callbacks
+// (either may be NULL); with a flush callback, the caller flushes whatever is left
+// between zout_done and zout at the end
+static int stbi__do_zlib_stream(stbi__zbuf *a, char *obuf, int olen, int parse_header)
+{
+   a->zout_start = obuf;
+   a->zout       = obuf;
+   a->zout_end   = obuf + olen;
+   a->z_expandable = 1;
+   a->zout_done  = obuf;
 
    return stbi__parse_zlib(a, parse_header);
 }
@@ -4630,8 +5300,10 @@ static int stbi__check_png_header(stbi__context *s)
 typedef struct
 {
    stbi__context *s;
-   stbi_uc *idata, *expanded, *out;
+   stbi_uc *expanded, *out;
    int depth;
+   int convert; // convert each row to req_comp components as it is unfiltered
+   int count;   // ... and count each greyscale row into s->histogram
 } stbi__png;
 
 
@@ -4667,6 +5339,135 @@ static int stbi__paeth(int a, int b, int c)
    return t1;
 }
 
+#ifdef STBI_SSE2
+// one pixel of n = 3, 4, 6 or 8 bytes in the low bytes of a register; n is always a
+// constant, so these compile down to the one or two loads and stores needed
+stbi_inline static __m128i stbi__load_px_sse2(const stbi_uc *p, int n)
+{
+   stbi__uint32 v;
+   if (n == 8) return _mm_loadl_epi64((const __m128i *) p);
+   if (n == 3) {
+      v = p[0] | (p[1] << 8) | (p[2] << 16);
+      return _mm_cvtsi32_si128((int) v);
+   }
+   memcpy(&v, p, 4);
+   if (n == 4) return _mm_cvtsi32_si128((int) v);
+   return _mm_insert_epi16(_mm_cvtsi32_si128((int) v), p[4] | (p[5] << 8), 2);
+}
+
+stbi_inline static void stbi__store_px_sse2(stbi_uc *p, __m128i px, int n)
+{
+   stbi__uint32 v;
+   if (n == 8) {
+      _mm_storel_epi64((__m128i *) p, px);
+      return;
+   }
+   v = (stbi__uint32) _mm_cvtsi128_si32(px);
+   if (n == 3) {
+      p[0] = (stbi_uc) v;
+      p[1] = (stbi_uc) (v >> 8);
+      p[2] = (stbi_uc) (v >> 16);
+      return;
+   }
+   memcpy(p, &v, 4);
+   if (n == 6) {
+      int w = _mm_extract_epi16(px, 2);
+      p[4] = (stbi_uc) w;
+      p[5] = (stbi_uc) (w >> 8);
+   }
+}
+
+// Sub, Avg and Paeth a pixel at a time, every byte of the pixel in parallel. a and c
+// are the previous pixels of cur and prior, 0 left of the row, which also takes care
+// of the first pixel. Paeth uses the same formulation as stbi__paeth in 16-bit lanes.
+stbi_inline static void stbi__unfilter_px_sse2(stbi_uc *cur, const stbi_uc *raw, const stbi_uc *prior, int filter, int n, int nk)
+{
+   __m128i zero = _mm_setzero_si128();
+   __m128i a = zero, b, c = zero;
+   int k;
+   if (filter == STBI__F_sub) {
+      for (k=0; k < nk; k += n) {
+         a = _mm_add_epi8(stbi__load_px_sse2(raw+k, n), a);
+         stbi__store_px_sse2(cur+k, a, n);
+      }
+   } else if (filter == STBI__F_avg || filter == STBI__F_avg_first) {
+      // _mm_avg_epu8 rounds up, so take off the low bit it rounded
+      for (k=0; k < nk; k += n) {
+         b = (filter == STBI__F_avg) ? stbi__load_px_sse2(prior+k, n) : zero;
+         b = _mm_sub_epi8(_mm_avg_epu8(a, b), _mm_and_si128(_mm_xor_si128(a, b), _mm_set1_epi8(1)));
+         a = _mm_add_epi8(stbi__load_px_sse2(raw+k, n), b);
+         stbi__store_px_sse2(cur+k, a, n);
+      }
+   } else {
+      STBI_ASSERT(filter == STBI__F_paeth);
+      // everything not depending on a is worked out first, to keep the chain from
+      // one pixel to the next short; the sum is masked rather than packed for it too
+      for (k=0; k < nk; k += n) {
+         __m128i x, thresh, lo, hi, t0, t1, m;
+         b = _mm_unpacklo_epi8(stbi__load_px_sse2(prior+k, n), zero);
+         x = _mm_unpacklo_epi8(stbi__load_px_sse2(raw+k, n), zero);
+         thresh = _mm_sub_epi16(_mm_add_epi16(c, _mm_add_epi16(c, c)), b);
+         thresh = _mm_sub_epi16(thresh, a);
+         lo = _mm_min_epi16(a, b);
+         hi = _mm_max_epi16(a, b);
+         m  = _mm_cmpgt_epi16(hi, thresh);
+         t0 = _mm_or_si128(_mm_and_si128(m, c), _mm_andnot_si128(m, lo));
+         m  = _mm_cmpgt_epi16(thresh, lo);
+         t1 = _mm_or_si128(_mm_and_si128(m, t0), _mm_andnot_si128(m, hi));
+         a = _mm_and_si128(_mm_add_epi16(x, t1), _mm_set1_epi16(0xff));
+         stbi__store_px_sse2(cur+k, _mm_packus_epi16(a, a), n);
+         c = b;
+      }
+   }
+}
+
+// unfilters one row of nk bytes with SSE2; returns 0 if the filter and pixel size
+// aren't handled here, which is Avg and Paeth on 1- and 2-byte pixels, where a
+// pixel at a time is no faster than the scalar loop
+static int stbi__unfilter_row_sse2(stbi_uc *cur, const stbi_uc *raw, const stbi_uc *prior, int filter, int filter_bytes, int nk)
+{
+   int k = 0;
+   if (filter == STBI__F_up) {
+      for (; k + 16 <= nk; k += 16)
+         _mm_storeu_si128((__m128i *) (cur+k), _mm_add_epi8(_mm_loadu_si128((const __m128i *) (raw+k)), _mm_loadu_si128((const __m128i *) (prior+k))));
+      for (; k < nk; ++k)
+         cur[k] = STBI__BYTECAST(raw[k] + prior[k]);
+      return 1;
+   }
+   switch (filter_bytes) {
+      case 3: stbi__unfilter_px_sse2(cur, raw, prior, filter, 3, nk); return 1;
+      case 4: stbi__unfilter_px_sse2(cur, raw, prior, filter, 4, nk); return 1;
+      case 6: stbi__unfilter_px_sse2(cur, raw, prior, filter, 6, nk); return 1;
+      case 8: stbi__unfilter_px_sse2(cur, raw, prior, filter, 8, nk); return 1;
+   }
+   if (filter != STBI__F_sub) return 0;
+
+   // Sub on 1- and 2-byte pixels is a running sum, so do 16 bytes at a time as a
+   // prefix sum in log steps, plus the last pixel of the previous 16
+   memcpy(cur, raw, filter_bytes);
+   k = filter_bytes;
+   for (; k + 16 <= nk; k += 16) {
+      __m128i x = _mm_loadu_si128((const __m128i *) (raw+k));
+      if (filter_bytes == 1) {
+         x = _mm_add_epi8(x, _mm_slli_si128(x, 1));
+         x = _mm_add_epi8(x, _mm_slli_si128(x, 2));
+         x = _mm_add_epi8(x, _mm_slli_si128(x, 4));
+         x = _mm_add_epi8(x, _mm_slli_si128(x, 8));
+         x = _mm_add_epi8(x, _mm_set1_epi8((char) cur[k-1]));
+      } else {
+         x = _mm_add_epi8(x, _mm_slli_si128(x, 2));
+         x = _mm_add_epi8(x, _mm_slli_si128(x, 4));
+         x = _mm_add_epi8(x, _mm_slli_si128(x, 8));
+         x = _mm_add_epi8(x, _mm_set1_epi16((short) (cur[k-2] | (cur[k-1] << 8))));
+      }
+      _mm_storeu_si128((__m128i *) (cur+k), x);
+   }
+   for (; k < nk; ++k)
+      cur[k] = STBI__BYTECAST(raw[k] + cur[k-filter_bytes]);
+   return 1;
+}
+#endif
+
 static const stbi_uc stbi__depth_scale_table[9] = { 0, 0xff, 0x55, 0, 0x11, 0,0,0, 0x01 };
 
 // adds an extra all-255 alpha channel
@@ -4692,67 +5493,103 @@ static void stbi__create_png_alpha_expand8(stbi_uc *dest, stbi_uc *src, stbi__ui
    }
 }
 
-// create the png data from post-deflated data
-static int stbi__create_png_image_raw(stbi__png *a, stbi_uc *raw, stbi__uint32 raw_len, int out_n, stbi__uint32 x, stbi__uint32 y, int depth, int color)
+// state for unfiltering a png a scanline at a time, so that rows can be decoded
+// while the rest of the image is still being inflated
+typedef struct
 {
-   int bytes = (depth == 16 ? 2 : 1);
-   stbi__context *s = a->s;
-   stbi__uint32 i,j,stride = x*out_n*bytes;
-   stbi__uint32 img_len, img_width_bytes;
-   stbi_uc *filter_buf;
-   int all_ok = 1;
-   int k;
-   int img_n = s->img_n; // copy it into a local for later
+   stbi__png *a;
+   stbi_uc *filter_buf, *row_buf;
+   stbi__uint32 x, y, j, stride, img_width_bytes;
+   int out_n, depth, color, width, filter_bytes, simd;
+} stbi__png_rows;
 
+static int stbi__png_rows_begin(stbi__png_rows *r, stbi__png *a, int out_n, stbi__uint32 x, stbi__uint32 y, int depth, int color)
+{
+   int bytes = (depth == 16 ? 2 : 1);
+   int img_n = a->s->img_n;
    int output_bytes = out_n*bytes;
-   int filter_bytes = img_n*bytes;
-   int width = x;
 
-   STBI_ASSERT(out_n == s->img_n || out_n == s->img_n+1);
+   STBI_ASSERT(a->convert || out_n == img_n || out_n == img_n+1);
+   r->a = a;
+   r->filter_buf = r->row_buf = NULL;
+   r->x = x;
+   r->y = y;
+   r->j = 0;
+   r->stride = x*output_bytes;
+   r->out_n = out_n;
+   r->depth = depth;
+   r->color = color;
+   r->width = x;
+   r->filter_bytes = img_n*bytes;
+   r->simd = stbi__convert_simd();
+
    a->out = (stbi_uc *) stbi__malloc_mad3(x, y, output_bytes, 0); // extra bytes to write off the end into
    if (!a->out) return stbi__err("outofmem", "Out of memory");
 
    // note: error exits here don't need to clean up a->out individually,
    // stbi__do_png always does on error.
    if (!stbi__mad3sizes_valid(img_n, x, depth, 7)) return stbi__err("too large", "Corrupt PNG");
-   img_width_bytes = (((img_n * x * depth) + 7) >> 3);
-   if (!stbi__mad2sizes_valid(img_width_bytes, y, img_width_bytes)) return stbi__err("too large", "Corrupt PNG");
-   img_len = (img_width_bytes + 1) * y;
-
-   // we used to check for exact match between raw_len and img_len on non-interlaced PNGs,
-   // but issue #276 reported a PNG in the wild that had extra data at the end (all zeros),
-   // so just check for raw_len < img_len always.
-   if (raw_len < img_len) return stbi__err("not enough pixels","Corrupt PNG");
+   r->img_width_bytes = (((img_n * x * depth) + 7) >> 3);
+   if (!stbi__mad2sizes_valid(r->img_width_bytes, y, r->img_width_bytes)) return stbi__err("too large", "Corrupt PNG");
 
    // Allocate two scan lines worth of filter workspace buffer.
-   filter_buf = (stbi_uc *) stbi__malloc_mad2(img_width_bytes, 2, 0);
-   if (!filter_buf) return stbi__err("outofmem", "Out of memory");
+   r->filter_buf = (stbi_uc *) stbi__malloc_mad2(r->img_width_bytes, 2, 0);
+   if (!r->filter_buf) return stbi__err("outofmem", "Out of memory");
+
+   // rows that aren't 8-bit are expanded or byte swapped into one more row before converting
+   if (a->convert && depth != 8) {
+      r->row_buf = (stbi_uc *) stbi__malloc_mad3(x, img_n, bytes, 0);
+      if (!r->row_buf) return stbi__err("outofmem", "Out of memory");
+   }
 
    // Filtering for low-bit-depth images
    if (depth < 8) {
-      filter_bytes = 1;
-      width = img_width_bytes;
+      r->filter_bytes = 1;
+      r->width = r->img_width_bytes;
    }
+   return 1;
+}
+
+static void stbi__png_rows_end(stbi__png_rows *r)
+{
+   STBI_FREE(r->filter_buf); r->filter_buf = NULL;
+   STBI_FREE(r->row_buf);    r->row_buf    = NULL;
+}
+
+// unfilter the next n rows, each a filter byte followed by img_width_bytes of data
+static int stbi__png_rows_decode(stbi__png_rows *r, stbi_uc *raw, stbi__uint32 n)
+{
+   stbi__png *a = r->a;
+   stbi__context *s = a->s;
+   stbi__uint32 i, x = r->x, img_width_bytes = r->img_width_bytes;
+   int depth = r->depth, out_n = r->out_n;
+   int img_n = s->img_n; // copy it into a local for later
+   int filter_bytes = r->filter_bytes;
+   int nk = r->width * filter_bytes;
+   int k;
 
-   for (j=0; j < y; ++j) {
+   for (; n > 0; --n, ++r->j) {
+      stbi__uint32 j = r->j;
       // cur/prior filter buffers alternate
-      stbi_uc *cur = filter_buf + (j & 1)*img_width_bytes;
-      stbi_uc *prior = filter_buf + (~j & 1)*img_width_bytes;
-      stbi_uc *dest = a->out + stride*j;
-      int nk = width * filter_bytes;
-      int filter = *raw++;
+      stbi_uc *cur = r->filter_buf + (j & 1)*img_width_bytes;
+      stbi_uc *prior = r->filter_buf + (~j & 1)*img_width_bytes;
+      stbi_uc *dest = a->out + r->stride*j;
+      int filter = *raw++, done;
 
       // check filter type
-      if (filter > 4) {
-         all_ok = stbi__err("invalid filter","Corrupt PNG");
-         break;
-      }
+      if (filter > 4)
+         return stbi__err("invalid filter","Corrupt PNG");
 
       // if first row, use special filter that doesn't sample previous row
       if (j == 0) filter = first_row_filter[filter];
 
       // perform actual filtering
-      switch (filter) {
+      done = 0;
+#ifdef STBI_SSE2
+      if (filter != STBI__F_none && r->simd)
+         done = stbi__unfilter_row_sse2(cur, raw, prior, filter, filter_bytes, nk);
+#endif
+      if (!done) switch (filter) {
       case STBI__F_none:
          memcpy(cur, raw, nk);
          break;
@@ -4788,9 +5625,9 @@ static int stbi__create_png_image_raw(stbi__png *a, stbi_uc *raw, stbi__uint32 r
 
       // expand decoded bits in cur to dest, also adding an extra alpha channel if desired
       if (depth < 8) {
-         stbi_uc scale = (color == 0) ? stbi__depth_scale_table[depth] : 1; // scale grayscale values to 0..255 range
+         stbi_uc scale = (r->color == 0) ? stbi__depth_scale_table[depth] : 1; // scale grayscale values to 0..255 range
          stbi_uc *in = cur;
-         stbi_uc *out = dest;
+         stbi_uc *out = a->convert ? r->row_buf : dest;
          stbi_uc inb = 0;
          stbi__uint32 nsmp = x*img_n;
 
@@ -4816,11 +5653,19 @@ static int stbi__create_png_image_raw(stbi__png *a, stbi_uc *raw, stbi__uint32 r
             }
          }
 
-         // insert alpha=255 values if desired
-         if (img_n != out_n)
+         // convert to the requested components, or insert alpha=255 values if desired
+         if (a->convert)
+            stbi__convert_row(dest, r->row_buf, img_n, out_n, x, r->simd);
+         else if (img_n != out_n)
             stbi__create_png_alpha_expand8(dest, dest, x, img_n);
       } else if (depth == 8) {
-         if (img_n == out_n)
+         if (a->convert) {
+            stbi__convert_row(dest, cur, img_n, out_n, x, r->simd);
+            // count the greyscale row while it is still in cache
+            if (a->count)
+               for (i=0; i < x; ++i)
+                  ++s->histogram[dest[i]];
+         } else if (img_n == out_n)
             memcpy(dest, cur, x*img_n);
          else
             stbi__create_png_alpha_expand8(dest, cur, x, img_n);
@@ -4829,7 +5674,15 @@ static int stbi__create_png_image_raw(stbi__png *a, stbi_uc *raw, stbi__uint32 r
          stbi__uint16 *dest16 = (stbi__uint16*)dest;
          stbi__uint32 nsmp = x*img_n;
 
-         if (img_n == out_n) {
+         if (a->convert) {
+            stbi__uint16 *row16 = (stbi__uint16*)r->row_buf;
+            for (i = 0; i < nsmp; ++i, cur += 2)
+               row16[i] = (cur[0] << 8) | cur[1];
+            stbi__convert_row16(dest16, row16, img_n, out_n, x, r->simd);
+            if (a->count)
+               for (i=0; i < x; ++i)
+                  ++s->histogram[dest16[i]];
+         } else if (img_n == out_n) {
             for (i = 0; i < nsmp; ++i, ++dest16, cur += 2)
                *dest16 = (cur[0] << 8) | cur[1];
          } else {
@@ -4852,12 +5705,164 @@ static int stbi__create_png_image_raw(stbi__png *a, stbi_uc *raw, stbi__uint32 r
       }
    }
 
-   STBI_FREE(filter_buf);
-   if (!all_ok) return 0;
-
    return 1;
 }
 
+// create the png data from post-deflated data
+static int stbi__create_png_image_raw(stbi__png *a, stbi_uc *raw, stbi__uint32 raw_len, int out_n, stbi__uint32 x, stbi__uint32 y, int depth, int color)
+{
+   stbi__png_rows r;
+   int ok = stbi__png_rows_begin(&r, a, out_n, x, y, depth, color);
+
+   // we used to check for exact match between raw_len and img_len on non-interlaced PNGs,
+   // but issue #276 reported a PNG in the wild that had extra data at the end (all zeros),
+   // so just check for raw_len < img_len always.
+   if (ok && raw_len < (r.img_width_bytes + 1) * y)
+      ok = stbi__err("not enough pixels","Corrupt PNG");
+   if (ok)
+      ok = stbi__png_rows_decode(&r, raw, y);
+
+   stbi__png_rows_end(&r);
+   return ok;
+}
+
+// zlib flush callback: unfilter every complete row that has been inflated so far
+static int stbi__png_rows_flush(void *user, stbi_uc *data, int len)
+{
+   stbi__png_rows *r = (stbi__png_rows *) user;
+   stbi__uint32 n = (stbi__uint32) len / (r->img_width_bytes + 1);
+   if (n > r->y - r->j) n = r->y - r->j;
+   if (!stbi__png_rows_decode(r, data, n)) return -1;
+   // anything after the last row is ignored, as in stbi__create_png_image_raw
+   if (r->j == r->y) return len;
+   return (int) (n * (r->img_width_bytes + 1));
+}
+
+#define STBI__PNG_WINDOW  (1 << 18)
+
+#ifdef STBI__PNG_PIPELINE
+#define STBI__PNG_RING           (1 << 17) // bytes of rows in flight between the threads
+#define STBI__PNG_PIPELINE_MIN   (1 << 20) // smaller images aren't worth a thread
+#define STBI__PNG_RING_ABORT     0xffffffffu
+
+// filtered rows passed from the inflater to the thread unfiltering them; produced and
+// consumed are only accessed through STBI_THREAD_WAIT and STBI_THREAD_STORE, so each
+// side keeps its own count as well
+typedef struct
+{
+   stbi__png_rows *r;
+   stbi_uc *slots;
+   stbi__uint32 nslots, row_len;
+   unsigned int produced, consumed; // rows published and unfiltered, or STBI__PNG_RING_ABORT
+   stbi__uint32 head, tail;         // the inflater's count, and its last sight of consumed
+   const char *error;               // failure reason from the unfiltering thread
+} stbi__png_ring;
+
+// flush callback for the inflater: copy whole rows into the ring as slots come free
+static int stbi__png_ring_flush(void *user, stbi_uc *data, int len)
+{
+   stbi__png_ring *q = (stbi__png_ring *) user;
+   stbi__uint32 n = (stbi__uint32) len / q->row_len, i;
+   if (n > q->r->y - q->head) n = q->r->y - q->head;
+   for (i=0; i < n; ++i, data += q->row_len) {
+      while (q->head - q->tail >= q->nslots) {
+         q->tail = STBI_THREAD_WAIT(&q->consumed, q->tail);
+         if (q->tail == STBI__PNG_RING_ABORT) return -1;
+      }
+      memcpy(q->slots + (q->head % q->nslots) * q->row_len, data, q->row_len);
+      STBI_THREAD_STORE(&q->produced, ++q->head);
+   }
+   if (q->head == q->r->y) return len;
+   return (int) (n * q->row_len);
+}
+
+// runs on the second thread until every row is done, or either side gives up
+static void stbi__png_ring_consume(void *user)
+{
+   stbi__png_ring *q = (stbi__png_ring *) user;
+   stbi__png_rows *r = q->r;
+   unsigned int avail = 0;
+   while (r->j < r->y) {
+      if (r->j == avail) {
+         avail = STBI_THREAD_WAIT(&q->produced, avail);
+         if (avail == STBI__PNG_RING_ABORT) return;
+         continue;
+      }
+      if (!stbi__png_rows_decode(r, q->slots + (r->j % q->nslots) * q->row_len, 1)) {
+         q->error = stbi__g_failure_reason;
+         STBI_THREAD_STORE(&q->consumed, STBI__PNG_RING_ABORT);
+         return;
+      }
+      STBI_THREAD_STORE(&q->consumed, r->j);
+   }
+}
+#endif
+
+// inflate a non-interlaced image into a small window, unfiltering rows as the window
+// fills, so the filtered image is never held in memory all at once
+static int stbi__create_png_image_streamed(stbi__png *a, stbi__zbuf *z, int out_n, int depth, int color, int parse_header)
+{
+   stbi__png_rows r;
+   char *window = NULL;
+#ifdef STBI__PNG_PIPELINE
+   stbi__png_ring q;
+   void *thread = NULL;
+#endif
+   int ok = stbi__png_rows_begin(&r, a, out_n, a->s->img_x, a->s->img_y, depth, color);
+
+   if (ok) {
+      // room for the 32K back reference window, a partial row and a whole stored block
+      size_t window_len = 32768 + 65536 + (size_t) r.img_width_bytes + 1;
+      if (window_len < STBI__PNG_WINDOW) window_len = STBI__PNG_WINDOW;
+      if (window_len > INT_MAX) ok = stbi__err("too large", "Corrupt PNG");
+      else if ((window = (char *) stbi__malloc(window_len)) == NULL) ok = stbi__err("outofmem", "Out of memory");
+      if (ok) {
+         z->flush = stbi__png_rows_flush;
+         z->flush_user = &r;
+#ifdef STBI__PNG_PIPELINE
+         // unfilter on a second thread while this one inflates
+         q.slots = NULL;
+         if ((size_t) (r.img_width_bytes + 1) * r.y >= STBI__PNG_PIPELINE_MIN) {
+            q.r = &r;
+            q.row_len = r.img_width_bytes + 1;
+            q.nslots = STBI__PNG_RING / q.row_len;
+            if (q.nslots < 4) q.nslots = 4;
+            q.produced = q.consumed = q.head = q.tail = 0;
+            q.error = NULL;
+            q.slots = (stbi_uc *) stbi__malloc_mad2(q.nslots, q.row_len, 0);
+            if (q.slots && (thread = STBI_THREAD_START(stbi__png_ring_consume, &q)) != NULL) {
+               z->flush = stbi__png_ring_flush;
+               z->flush_user = &q;
+            }
+         }
+#endif
+         ok = stbi__do_zlib_stream(z, window, (int) window_len, parse_header);
+         // hand over whatever is left in the window
+         if (ok)
+            ok = z->flush(z->flush_user, (stbi_uc *) z->zout_done, (int) (z->zout - z->zout_done)) >= 0;
+         STBI_FREE(z->zout_start);
+#ifdef STBI__PNG_PIPELINE
+         if (thread) {
+            // if the inflate stopped short, the other thread is still waiting for rows
+            if (q.head < r.y)
+               STBI_THREAD_STORE(&q.produced, STBI__PNG_RING_ABORT);
+            STBI_THREAD_JOIN(thread);
+            if (q.error) {
+               stbi__g_failure_reason = q.error;
+               ok = 0;
+            }
+         }
+         STBI_FREE(q.slots);
+#endif
+      }
+   }
+   if (ok && r.j < r.y)
+      ok = stbi__err("not enough pixels","Corrupt PNG");
+
+   stbi__png_rows_end(&r);
+   return ok;
+}
+
 static int stbi__create_png_image(stbi__png *a, stbi_uc *image_data, stbi__uint32 image_data_len, int out_n, int depth, int color, int interlaced)
 {
    int bytes = (depth == 16 ? 2 : 1);
@@ -4903,6 +5908,26 @@ static int stbi__create_png_image(stbi__png *a, stbi_uc *image_data, stbi__uint3
    return 1;
 }
 
+// the exact size of the filtered image data, with a filter byte per row of each pass
+static stbi__uint32 stbi__png_raw_len(stbi__context *s, int depth, int interlaced)
+{
+   int xorig[] = { 0,4,0,2,0,1,0 };
+   int yorig[] = { 0,0,4,0,2,0,1 };
+   int xspc[]  = { 8,8,4,4,2,2,1 };
+   int yspc[]  = { 8,8,8,4,4,2,2 };
+   stbi__uint32 x, y, len = 0;
+   int p;
+   if (!interlaced)
+      return ((((s->img_n * s->img_x * depth) + 7) >> 3) + 1) * s->img_y;
+   for (p=0; p < 7; ++p) {
+      x = (s->img_x - xorig[p] + xspc[p]-1) / xspc[p];
+      y = (s->img_y - yorig[p] + yspc[p]-1) / yspc[p];
+      if (x && y)
+         len += ((((s->img_n * x * depth) + 7) >> 3) + 1) * y;
+   }
+   return len;
+}
+
 static int stbi__compute_transparency(stbi__png *z, stbi_uc tc[3], int out_n)
 {
    stbi__context *s = z->s;
@@ -5075,25 +6100,105 @@ static void stbi__de_iphone(stbi__png *z)
 
 #define STBI__PNG_TYPE(a,b,c,d)  (((unsigned) (a) << 24) + ((unsigned) (b) << 16) + ((unsigned) (c) << 8) + (unsigned) (d))
 
+// feeds the zlib stream to the inflater straight out of the run of IDAT chunks, so
+// they never have to be gathered into one buffer; images already in memory are
+// read in place
+typedef struct
+{
+   stbi__context *s;
+   stbi__uint32 left;   // bytes of the current IDAT not handed out yet
+   stbi__pngchunk next; // the header of the chunk that ended the run, if has_next
+   int has_next;
+   stbi_uc *buffer;     // staging buffer when reading through callbacks
+} stbi__png_idat;
+
+#define STBI__PNG_IDAT_BUFFER  (1 << 16)
+
+static int stbi__png_idat_refill(void *user, stbi_uc **start, stbi_uc **end)
+{
+   stbi__png_idat *d = (stbi__png_idat *) user;
+   stbi__context *s = d->s;
+   stbi__uint32 n;
+
+   while (d->left == 0) {
+      if (d->has_next) return 0;
+      stbi__get32be(s); // CRC of the IDAT just finished
+      d->next = stbi__get_chunk_header(s);
+      if (d->next.type != STBI__PNG_TYPE('I','D','A','T')) {
+         d->has_next = 1;
+         return 0;
+      }
+      if (d->next.length > (1u << 30)) return stbi__err("IDAT size limit", "IDAT section larger than 2^30 bytes");
+      d->left = d->next.length;
+   }
+
+   if (!d->buffer) {
+      n = (stbi__uint32) (s->img_buffer_end - s->img_buffer);
+      if (n == 0) return stbi__err("outofdata","Corrupt PNG");
+      if (n > d->left) n = d->left;
+      *start = s->img_buffer;
+      s->img_buffer += n;
+   } else {
+      n = d->left < STBI__PNG_IDAT_BUFFER ? d->left : STBI__PNG_IDAT_BUFFER;
+      if (!stbi__getn(s, d->buffer, n)) return stbi__err("outofdata","Corrupt PNG");
+      *start = d->buffer;
+   }
+   *end = *start + n;
+   d->left -= n;
+   return 1;
+}
+
+// inflate and unfilter the image, starting from the IDAT whose header was just read.
+// Non-interlaced images are unfiltered as they are inflated; interlaced ones are
+// inflated into a buffer sized exactly from IHDR first.
+static int stbi__png_decode_idat(stbi__png *z, stbi__png_idat *d, int out_n, int color, int interlace, int parse_header)
+{
+   stbi__context *s = z->s;
+   stbi__zbuf zb;
+   stbi__uint32 raw_len;
+
+   zb.zbuffer = zb.zbuffer_end = NULL;
+   zb.refill = stbi__png_idat_refill;
+   zb.refill_user = d;
+   zb.flush = NULL;
+   if (!interlace)
+      return stbi__create_png_image_streamed(z, &zb, out_n, z->depth, color, parse_header);
+
+   raw_len = stbi__png_raw_len(s, z->depth, interlace);
+   if (raw_len > INT_MAX) return stbi__err("too large", "Corrupt PNG");
+   z->expanded = (stbi_uc *) stbi__malloc(raw_len);
+   if (!z->expanded) return stbi__err("outofmem", "Out of memory");
+   if (!stbi__do_zlib_stream(&zb, (char *) z->expanded, (int) raw_len, parse_header)) {
+      z->expanded = (stbi_uc *) zb.zout_start; // may have been grown; stbi__do_png frees it
+      return 0;
+   }
+   z->expanded = (stbi_uc *) zb.zout_start;
+   raw_len = (stbi__uint32) (zb.zout - zb.zout_start);
+   return stbi__create_png_image(z, z->expanded, raw_len, out_n, z->depth, color, interlace);
+}
+
 static int stbi__parse_png_file(stbi__png *z, int scan, int req_comp)
 {
    stbi_uc palette[1024], pal_img_n=0;
    stbi_uc has_trans=0, tc[3]={0};
    stbi__uint16 tc16[3];
-   stbi__uint32 ioff=0, idata_limit=0, i, pal_len=0;
-   int first=1,k,interlace=0, color=0, is_iphone=0;
+   stbi__uint32 i, pal_len=0;
+   int first=1,k,interlace=0, color=0, is_iphone=0, decoded=0, has_pending=0;
+   stbi__pngchunk c, pending;
    stbi__context *s = z->s;
 
    z->expanded = NULL;
-   z->idata = NULL;
    z->out = NULL;
+   z->convert = z->count = 0;
 
    if (!stbi__check_png_header(s)) return 0;
 
    if (scan == STBI__SCAN_type) return 1;
 
    for (;;) {
-      stbi__pngchunk c = stbi__get_chunk_header(s);
+      // decoding the image data reads on to the header of the chunk after the IDATs
+      c = has_pending ? pending : stbi__get_chunk_header(s);
+      has_pending = 0;
       switch (c.type) {
          case STBI__PNG_TYPE('C','g','B','I'):
             is_iphone = 1;
@@ -5145,7 +6250,7 @@ static int stbi__parse_png_file(stbi__png *z, int scan, int req_comp)
 
          case STBI__PNG_TYPE('t','R','N','S'): {
             if (first) return stbi__err("first not IHDR", "Corrupt PNG");
-            if (z->idata) return stbi__err("tRNS after IDAT","Corrupt PNG");
+            if (decoded) return stbi__err("tRNS after IDAT","Corrupt PNG");
             if (pal_img_n) {
                if (scan == STBI__SCAN_header) { s->img_n = 4; return 1; }
                if (pal_len == 0) return stbi__err("tRNS before PLTE","Corrupt PNG");
@@ -5180,39 +6285,57 @@ static int stbi__parse_png_file(stbi__png *z, int scan, int req_comp)
                return 1;
             }
             if (c.length > (1u << 30)) return stbi__err("IDAT size limit", "IDAT section larger than 2^30 bytes");
-            if ((int)(ioff + c.length) < (int)ioff) return 0;
-            if (ioff + c.length > idata_limit) {
-               stbi__uint32 idata_limit_old = idata_limit;
-               stbi_uc *p;
-               if (idata_limit == 0) idata_limit = c.length > 4096 ? c.length : 4096;
-               while (ioff + c.length > idata_limit)
-                  idata_limit *= 2;
-               STBI_NOTUSED(idata_limit_old);
-               p = (stbi_uc *) STBI_REALLOC_SIZED(z->idata, idata_limit_old, idata_limit); if (p == NULL) return stbi__err("outofmem", "Out of memory");
-               z->idata = p;
+            if (decoded) {
+               // any IDATs left after the end of the zlib stream
+               stbi__skip(s, c.length);
+               break;
+            }
+            decoded = 1;
+            // non-interlaced images without a palette can be converted to req_comp a row at a
+            // time, so the full color image is never built; a greyscale load that wants a
+            // histogram also counts each row as it is converted. tRNS alpha is only needed
+            // if it survives the conversion.
+            if (!interlace && !pal_img_n && !is_iphone) {
+               z->count = s->histogram && req_comp == 1 && z->depth == s->histogram_bits;
+               z->convert = req_comp && (req_comp != s->img_n || z->count) && !(has_trans && (req_comp == 2 || req_comp == 4));
+            }
+            if (z->convert)
+               s->img_out_n = req_comp;
+            else if ((req_comp == s->img_n+1 && req_comp != 3 && !pal_img_n) || has_trans)
+               s->img_out_n = s->img_n+1;
+            else
+               s->img_out_n = s->img_n;
+            {
+               stbi__png_idat d;
+               int ok;
+               d.s = s;
+               d.left = c.length;
+               d.has_next = 0;
+               d.buffer = NULL;
+               if (s->read_from_callbacks) {
+                  d.buffer = (stbi_uc *) stbi__malloc(STBI__PNG_IDAT_BUFFER);
+                  if (!d.buffer) return stbi__err("outofmem", "Out of memory");
+               }
+               ok = stbi__png_decode_idat(z, &d, s->img_out_n, color, interlace, !is_iphone);
+               STBI_FREE(d.buffer);
+               if (!ok) return 0;
+               if (d.has_next) {
+                  // the CRC of the last IDAT has been read too
+                  pending = d.next;
+                  has_pending = 1;
+                  continue;
+               }
+               stbi__skip(s, d.left);
             }
-            if (!stbi__getn(s, z->idata+ioff,c.length)) return stbi__err("outofdata","Corrupt PNG");
-            ioff += c.length;
             break;
          }
 
          case STBI__PNG_TYPE('I','E','N','D'): {
-            stbi__uint32 raw_len, bpl;
             if (first) return stbi__err("first not IHDR", "Corrupt PNG");
             if (scan != STBI__SCAN_load) return 1;
-            if (z->idata == NULL) return stbi__err("no IDAT","Corrupt PNG");
-            // initial guess for decoded data size to avoid unnecessary reallocs
-            bpl = (s->img_x * z->depth + 7) / 8; // bytes per line, per component
-            raw_len = bpl * s->img_y * s->img_n /* pixels */ + s->img_y /* filter mode per row */;
-            z->expanded = (stbi_uc *) stbi_zlib_decode_malloc_guesssize_headerflag((char *) z->idata, ioff, raw_len, (int *) &raw_len, !is_iphone);
-            if (z->expanded == NULL) return 0; // zlib should set error
-            STBI_FREE(z->idata); z->idata = NULL;
-            if ((req_comp == s->img_n+1 && req_comp != 3 && !pal_img_n) || has_trans)
-               s->img_out_n = s->img_n+1;
-            else
-               s->img_out_n = s->img_n;
-            if (!stbi__create_png_image(z, z->expanded, raw_len, s->img_out_n, z->depth, color, interlace)) return 0;
-            if (has_trans) {
+            if (!decoded) return stbi__err("no IDAT","Corrupt PNG");
+            s->histogram_counted = z->count;
+            if (has_trans && !z->convert) {
                if (z->depth == 16) {
                   if (!stbi__compute_transparency16(z, tc16, s->img_out_n)) return 0;
                } else {
@@ -5287,7 +6410,6 @@ static void *stbi__do_png(stbi__png *p, int *x, int *y, int *n, int req_comp, st
    }
    STBI_FREE(p->out);      p->out      = NULL;
    STBI_FREE(p->expanded); p->expanded = NULL;
-   STBI_FREE(p->idata);    p->idata    = NULL;
 
    return result;
 }
@@ -26,6 +26,15 @@ BUILDING:
    You can #define STBIW_MALLOC(), STBIW_REALLOC(), and STBIW_FREE() to replace
    malloc,realloc,free.
    You can #define STBIW_MEMMOVE() to replace memmove()
+   You can #define STBIW_CRC32(buffer,len) and STBIW_ADLER32(data,len) to
+   replace the PNG chunk CRC-32 and the zlib Adler-32 with faster versions;
+   both return the finished checksum of the whole buffer.
+   You can #define STBIW_NO_SIMD to turn off the SSE2 PNG filter kernels.
+   You can #define STBIW_PARALLEL_FOR(n,task,context) to spread PNG encoding
+   over threads; it must call task(context, i) once for each i in [0,n) and
+   return when they have all finished. The calls are independent of each
+   other. By default they are made in order on the calling thread. The PNG
+   output is the same either way.
    You can #define STBIW_ZLIB_COMPRESS to use a custom zlib-style compress function
    for PNG compression (instead of the builtin one), it must have the following signature:
    unsigned char * my_compress(unsigned char *data, int data_len, int *out_len, int quality);
@@ -50,6 +59,10 @@ USAGE:
      int stbi_write_jpg(char const *filename, int w, int h, int comp, const void *data, int quality);
      int stbi_write_hdr(char const *filename, int w, int h, int comp, const float *data);
 
+   and one for bilevel images already packed 8 pixels to a byte:
+
+     int stbi_write_png_1bit(char const *filename, int w, int h, const void *bits, int stride_in_bytes);
+
      void stbi_flip_vertically_on_write(int flag); // flag is non-zero to flip data vertically
 
    There are also five equivalent functions that use an arbitrary write function. You are
@@ -60,6 +73,7 @@ USAGE:
      int stbi_write_tga_to_func(stbi_write_func *func, void *context, int w, int h, int comp, const void  *data);
      int stbi_write_hdr_to_func(stbi_write_func *func, void *context, int w, int h, int comp, const float *data);
      int stbi_write_jpg_to_func(stbi_write_func *func, void *context, int x, int y, int comp, const void *data, int quality);
+     int stbi_write_png_1bit_to_func(stbi_write_func *func, void *context, int w, int h, const void *bits, int stride_in_bytes);
 
    where the callback is:
       void stbi_write_func(void *context, void *data, int size);
@@ -96,8 +110,20 @@ USAGE:
    writer, both because it is in BGR order and because it may have padding
    at the end of the line.)
 
+   stbi_write_png_1bit writes a bit depth 1 greyscale PNG. Each row of 'bits'
+   holds w pixels packed most significant bit first, 1 for white and 0 for
+   black, which is the PNG layout, so rows are filtered and compressed as is
+   with no expansion to 8 bits. Bits past w in the last byte of a row are
+   ignored by readers. Only the None and Up filters are tried, since the
+   others do not line up with packed pixels.
+
    PNG allows you to set the deflate compression level by setting the global
-   variable 'stbi_write_png_compression_level' (it defaults to 8).
+   variable 'stbi_write_png_compression_level' (it defaults to 8). Levels 1
+   to 4 trade some compression for speed with a hash chain compressor; from
+   5 up, higher levels keep more candidates per hash bucket. Setting it
+   to STBIW_ZLIB_BILEVEL selects a much faster compressor for black and white
+   images, which only looks for runs and for repeats of the previous row, and
+   codes them with a fixed Huffman table tuned for that kind of data.
 
    HDR expects linear float data. Since the format is always 32-bit rgb(e)
    data, alpha (if provided) is discarded, and for monochrome data it is
@@ -178,6 +204,7 @@ STBIWDEF int stbi_write_bmp(char const *filename, int w, int h, int comp, const
 STBIWDEF int stbi_write_tga(char const *filename, int w, int h, int comp, const void  *data);
 STBIWDEF int stbi_write_hdr(char const *filename, int w, int h, int comp, const float *data);
 STBIWDEF int stbi_write_jpg(char const *filename, int x, int y, int comp, const void  *data, int quality);
+STBIWDEF int stbi_write_png_1bit(char const *filename, int w, int h, const void  *bits, int stride_in_bytes);
 
 #ifdef STBIW_WINDOWS_UTF8
 STBIWDEF int stbiw_convert_wchar_to_utf8(char *buffer, size_t bufferlen, const wchar_t* input);
@@ -191,9 +218,13 @@ STBIWDEF int stbi_write_bmp_to_func(stbi_write_func *func, void *context, int w,
 STBIWDEF int stbi_write_tga_to_func(stbi_write_func *func, void *context, int w, int h, int comp, const void  *data);
 STBIWDEF int stbi_write_hdr_to_func(stbi_write_func *func, void *context, int w, int h, int comp, const float *data);
 STBIWDEF int stbi_write_jpg_to_func(stbi_write_func *func, void *context, int x, int y, int comp, const void  *data, int quality);
+STBIWDEF int stbi_write_png_1bit_to_func(stbi_write_func *func, void *context, int w, int h, const void  *bits, int stride_in_bytes);
 
 STBIWDEF void stbi_flip_vertically_on_write(int flip_boolean);
 
+// compression level for black and white images: runs and row repeats only
+#define STBIW_ZLIB_BILEVEL  (-1)
+
 #endif//INCLUDE_STB_IMAGE_WRITE_H
 
 #ifdef STB_IMAGE_WRITE_IMPLEMENTATION
@@ -239,6 +270,10 @@ STBIWDEF void stbi_flip_vertically_on_write(int flip_boolean);
 #define STBIW_MEMMOVE(a,b,sz) memmove(a,b,sz)
 #endif
 
+#ifndef STBIW_PARALLEL_FOR
+#define STBIW_PARALLEL_FOR(n,task,context) do { int stbiw__t; for (stbiw__t=0; stbiw__t < (n); ++stbiw__t) (task)(context, stbiw__t); } while (0)
+#endif
+
 
 #ifndef STBIW_ASSERT
 #include <assert.h>
@@ -247,6 +282,14 @@ STBIWDEF void stbi_flip_vertically_on_write(int flip_boolean);
 
 #define STBIW_UCHAR(x) (unsigned char) ((x) & 0xff)
 
+#if !defined(STBIW_NO_SIMD) && (defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2))
+#define STBIW_SSE2
+#include <emmintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#endif
+
 #ifdef STB_IMAGE_WRITE_STATIC
 static int stbi_write_png_compression_level = 8;
 static int stbi_write_tga_with_rle = 1;
@@ -856,10 +899,44 @@ static int stbiw__zlib_bitrev(int code, int codebits)
    return res;
 }
 
+#ifdef STBIW_SSE2
+static int stbiw__ctz(unsigned int x) // x != 0
+{
+#if defined(_MSC_VER)
+   unsigned long i;
+   _BitScanForward(&i, x);
+   return (int) i;
+#elif defined(__GNUC__) || defined(__clang__)
+   return __builtin_ctz(x);
+#else
+   int i = 0;
+   while (!(x & 1)) { x >>= 1; ++i; }
+   return i;
+#endif
+}
+#endif
+
+// length of the match between a and b, up to limit and 258; compares 16
+// bytes at a time and finds the first difference from the compare mask
 static unsigned int stbiw__zlib_countm(unsigned char *a, unsigned char *b, int limit)
 {
-   int i;
-   for (i=0; i < limit && i < 258; ++i)
+   int i = 0;
+   if (limit > 258) limit = 258;
+#ifdef STBIW_SSE2
+   for (; i + 16 <= limit; i += 16) {
+      int eq = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((__m128i *) (a+i)), _mm_loadu_si128((__m128i *) (b+i))));
+      if (eq != 0xffff)
+         return i + stbiw__ctz(~eq & 0xffff);
+   }
+#else
+   for (; i + 8 <= limit; i += 8) {
+      stbiw_uint32 a0,a1,b0,b1;
+      memcpy(&a0, a+i, 4); memcpy(&a1, a+i+4, 4);
+      memcpy(&b0, b+i, 4); memcpy(&b1, b+i+4, 4);
+      if (a0 != b0 || a1 != b1) break;
+   }
+#endif
+   for (; i < limit; ++i)
       if (a[i] != b[i]) break;
    return i;
 }
@@ -890,14 +967,32 @@ static unsigned int stbiw__zhash(unsigned char *data)
 
 #define stbiw__ZHASH   16384
 
-#endif // STBIW_ZLIB_COMPRESS
+// input bytes per deflate chunk; chunks are compressed independently (see
+// STBIW_PARALLEL_FOR), each able to match into the 32K before it
+#define stbiw__ZCHUNK  (1 << 18)
 
-STBIWDEF unsigned char * stbi_zlib_compress(unsigned char *data, int data_len, int *out_len, int quality)
+// ends a chunk: the last one ends the stream, the others end on a byte
+// boundary with an empty stored block (a sync flush), so that compressed
+// chunks can simply be concatenated
+static unsigned char *stbiw__zlib_end_chunk(unsigned char *out, unsigned int bitbuf, int bitcount, int final)
+{
+   if (!final)
+      stbiw__zlib_add(0,3);  // BFINAL = 0, BTYPE = 0 -- no compression
+   // pad with 0 bits to byte boundary
+   while (bitcount)
+      stbiw__zlib_add(0,1);
+   if (!final) {
+      stbiw__sbpush(out, 0x00); // LEN = 0
+      stbiw__sbpush(out, 0x00);
+      stbiw__sbpush(out, 0xff); // NLEN
+      stbiw__sbpush(out, 0xff);
+   }
+   return out;
+}
+
+// raw deflate of data[begin,end) with the builtin hash chain compressor
+static unsigned char *stbiw__zlib_deflate_chunk(unsigned char *data, int begin, int end, int final, int quality)
 {
-#ifdef STBIW_ZLIB_COMPRESS
-   // user provided a zlib compress implementation, use that
-   return STBIW_ZLIB_COMPRESS(data, data_len, out_len, quality);
-#else // use builtin
    static unsigned short lengthc[] = { 3,4,5,6,7,8,9,10,11,13,15,17,19,23,27,31,35,43,51,59,67,83,99,115,131,163,195,227,258, 259 };
    static unsigned char  lengtheb[]= { 0,0,0,0,0,0,0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4,  4,  5,  5,  5,  5,  0 };
    static unsigned short distc[]   = { 1,2,3,4,5,7,9,13,17,25,33,49,65,97,129,193,257,385,513,769,1025,1537,2049,3073,4097,6145,8193,12289,16385,24577, 32768 };
@@ -910,16 +1005,24 @@ STBIWDEF unsigned char * stbi_zlib_compress(unsigned char *data, int data_len, i
       return NULL;
    if (quality < 5) quality = 5;
 
-   stbiw__sbpush(out, 0x78);   // DEFLATE 32K window
-   stbiw__sbpush(out, 0x5e);   // FLEVEL = 1
-   stbiw__zlib_add(1,1);  // BFINAL = 1
+   stbiw__zlib_add(final,1);  // BFINAL
    stbiw__zlib_add(1,2);  // BTYPE = 1 -- fixed huffman
 
    for (i=0; i < stbiw__ZHASH; ++i)
       hash_table[i] = NULL;
 
-   i=0;
-   while (i < data_len-3) {
+   // seed the hash table with the window before the chunk
+   for (i = begin > 32768 ? begin-32768 : 0; i < begin && i < end-3; ++i) {
+      int h = stbiw__zhash(data+i)&(stbiw__ZHASH-1);
+      if (hash_table[h] && stbiw__sbn(hash_table[h]) == 2*quality) {
+         STBIW_MEMMOVE(hash_table[h], hash_table[h]+quality, sizeof(hash_table[h][0])*quality);
+         stbiw__sbn(hash_table[h]) = quality;
+      }
+      stbiw__sbpush(hash_table[h],data+i);
+   }
+
+   i=begin;
+   while (i < end-3) {
       // hash next 3 bytes of data to be compressed
       int h = stbiw__zhash(data+i)&(stbiw__ZHASH-1), best=3;
       unsigned char *bestloc = 0;
@@ -927,7 +1030,7 @@ STBIWDEF unsigned char * stbi_zlib_compress(unsigned char *data, int data_len, i
       int n = stbiw__sbcount(hlist);
       for (j=0; j < n; ++j) {
          if (hlist[j]-data > i-32768) { // if entry lies within window
-            int d = stbiw__zlib_countm(hlist[j], data+i, data_len-i);
+            int d = stbiw__zlib_countm(hlist[j], data+i, end-i);
             if (d >= best) { best=d; bestloc=hlist[j]; }
          }
       }
@@ -945,7 +1048,7 @@ STBIWDEF unsigned char * stbi_zlib_compress(unsigned char *data, int data_len, i
          n = stbiw__sbcount(hlist);
          for (j=0; j < n; ++j) {
             if (hlist[j]-data > i-32767) {
-               int e = stbiw__zlib_countm(hlist[j], data+i+1, data_len-i-1);
+               int e = stbiw__zlib_countm(hlist[j], data+i+1, end-i-1);
                if (e > best) { // if next match is better, bail on current match
                   bestloc = NULL;
                   break;
@@ -970,19 +1073,270 @@ STBIWDEF unsigned char * stbi_zlib_compress(unsigned char *data, int data_len, i
       }
    }
    // write out final bytes
-   for (;i < data_len; ++i)
+   for (;i < end; ++i)
       stbiw__zlib_huffb(data[i]);
    stbiw__zlib_huff(256); // end of block
-   // pad with 0 bits to byte boundary
-   while (bitcount)
-      stbiw__zlib_add(0,1);
 
    for (i=0; i < stbiw__ZHASH; ++i)
       (void) stbiw__sbfree(hash_table[i]);
    STBIW_FREE(hash_table);
 
+   return stbiw__zlib_end_chunk(out, bitbuf, bitcount, final);
+}
+
+#define stbiw__ZCHAIN  32768   // hash heads for the hash chain compressor
+
+// longest match for data+i among the earlier positions chained from its hash
+static int stbiw__zlib_longest(unsigned char *data, int *head, int *prev, int i, int end, int chain, int *dist)
+{
+   int best = 2, p = head[stbiw__zhash(data+i)&(stbiw__ZCHAIN-1)];
+   while (p >= 0 && i - p < 32768 && chain--) {
+      int next;
+      // the byte that would make the match longer is the cheapest to reject on
+      if (data[p+best] == data[i+best] && data[p] == data[i]) {
+         int d = stbiw__zlib_countm(data+p, data+i, end-i);
+         if (d > best) {
+            best = d;
+            *dist = i - p;
+            if (d == 258 || d == end-i) break;
+         }
+      }
+      next = prev[p & 32767];
+      if (next >= p) break; // slot reused by a newer position
+      p = next;
+   }
+   return best >= 3 ? best : 0;
+}
+
+// Raw deflate of data[begin,end) for levels 1 to 4. Positions are kept in
+// zlib-style head/prev arrays, so nothing is reallocated per bucket, and
+// each chain is walked at most 4 << (quality-1) deep. From level 3 up the
+// match at the next byte is also checked (lazy matching).
+static unsigned char *stbiw__zlib_deflate_fast(unsigned char *data, int begin, int end, int final, int quality)
+{
+   static unsigned short lengthc[] = { 3,4,5,6,7,8,9,10,11,13,15,17,19,23,27,31,35,43,51,59,67,83,99,115,131,163,195,227,258, 259 };
+   static unsigned char  lengtheb[]= { 0,0,0,0,0,0,0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4,  4,  5,  5,  5,  5,  0 };
+   static unsigned short distc[]   = { 1,2,3,4,5,7,9,13,17,25,33,49,65,97,129,193,257,385,513,769,1025,1537,2049,3073,4097,6145,8193,12289,16385,24577, 32768 };
+   static unsigned char  disteb[]  = { 0,0,0,0,1,1,2,2,3,3,4,4,5,5,6,6,7,7,8,8,9,9,10,10,11,11,12,12,13,13 };
+   unsigned int bitbuf=0;
+   int i,j, bitcount=0, inserted, best, d=0;
+   int chain, lazy = quality >= 3;
+   unsigned char *out = NULL;
+   int *head = (int *) STBIW_MALLOC(sizeof(int) * (stbiw__ZCHAIN + 32768)), *prev;
+   if (head == NULL)
+      return NULL;
+   prev = head + stbiw__ZCHAIN;
+   if (quality < 1) quality = 1;
+   chain = 4 << (quality-1);
+
+   stbiw__zlib_add(final,1);  // BFINAL
+   stbiw__zlib_add(1,2);  // BTYPE = 1 -- fixed huffman
+
+   for (i=0; i < stbiw__ZCHAIN; ++i)
+      head[i] = -1;
+   // everything before 'inserted' is in the chains, starting with the window before the chunk
+   inserted = begin > 32768 ? begin-32768 : 0;
+
+   i=begin;
+   while (i < end-3) {
+      for (; inserted < i; ++inserted) {
+         int h = stbiw__zhash(data+inserted)&(stbiw__ZCHAIN-1);
+         prev[inserted & 32767] = head[h];
+         head[h] = inserted;
+      }
+      best = stbiw__zlib_longest(data, head, prev, i, end, chain, &d);
+      if (best && lazy && best < 258 && i+1 < end-3) {
+         int next_d, h = stbiw__zhash(data+i)&(stbiw__ZCHAIN-1);
+         prev[i & 32767] = head[h];
+         head[h] = i;
+         inserted = i+1;
+         if (stbiw__zlib_longest(data, head, prev, i+1, end, chain, &next_d) > best)
+            best = 0; // the next byte starts a longer match, so this one goes out as a literal
+      }
+
+      if (best) {
+         for (j=0; best > lengthc[j+1]-1; ++j);
+         stbiw__zlib_huff(j+257);
+         if (lengtheb[j]) stbiw__zlib_add(best - lengthc[j], lengtheb[j]);
+         for (j=0; d > distc[j+1]-1; ++j);
+         stbiw__zlib_add(stbiw__zlib_bitrev(j,5),5);
+         if (disteb[j]) stbiw__zlib_add(d - distc[j], disteb[j]);
+         i += best;
+      } else {
+         stbiw__zlib_huffb(data[i]);
+         ++i;
+      }
+   }
+   // write out final bytes
+   for (;i < end; ++i)
+      stbiw__zlib_huffb(data[i]);
+   stbiw__zlib_huff(256); // end of block
+
+   STBIW_FREE(head);
+   return stbiw__zlib_end_chunk(out, bitbuf, bitcount, final);
+}
+
+// Huffman code lengths for literals/lengths, from symbol counts of filtered
+// 1-bit and 8-bit black and white PNGs (0x00 and 0xff, single edges within a
+// byte, long lengths). Every symbol has a code and the code is complete.
+static unsigned char stbiw__bilevel_litlen[286] =
+{
+       2, 4, 7, 8, 7, 9, 8, 9, 7,10,10,10, 8,10, 9, 9,
+       7, 9, 9,10,10,11,10,10, 8,10,10,10, 9,10, 9, 9,
+       7, 9,10,10,10,11,10,10,10,11,10,11,10,11,10,10,
+       8,10,10,11,10,10,10,10, 9,10,10,10, 9,10, 9, 9,
+       6, 9, 9,10, 9,10,10,10, 9,11,11,11,10,11,10,10,
+       9,10,11,11,10,11,11,11,10,11,10,11,10,11,10,10,
+       8,10,10,11,10,10,11,11,10,10,11,11,10,11,10,11,
+       9,10,10,11,10,11,10,10, 9,10,10,10, 9,10, 9, 9,
+       6, 9, 9,10, 9,10,10,10, 9,10,10,11,10,11,10,10,
+       9,10,10,11,10,11,10,10,10,11,11,11,10,11,10,10,
+       8,10,10,10,10,11,10,11,10,11,10,11,10,11,10,10,
+       9,10,10,12,10,11,10,10, 9,11,10,11, 9,10, 9,10,
+       6, 9,10,10, 9,10,10,10, 9,11,11,10,10,11,10,10,
+       8,10,10,10,10,11,10,11,10,10,10,10,10,10,10, 9,
+       7, 9, 9,10, 9,11,10,10, 8,10,10,10, 9,10,10, 9,
+       7, 9, 9,10, 8,10, 9, 9, 7, 8, 8, 9, 7, 8, 7, 4,
+      12, 5, 6, 6, 7, 7, 7, 8, 8, 7, 7, 8, 8, 7, 8, 8,
+       8, 6, 7, 9, 9, 9, 6, 9,10, 9, 9,10,10, 6
+};
+
+// builds bit-reversed canonical codes from code lengths
+static void stbiw__zlib_canonical(const unsigned char *lengths, int n, unsigned short *codes)
+{
+   int count[16] = { 0 }, next[16];
+   int i, code = 0;
+   for (i=0; i < n; ++i) ++count[lengths[i]];
+   count[0] = 0;
+   for (i=1; i < 16; ++i) {
+      code = (code + count[i-1]) << 1;
+      next[i] = code;
+   }
+   for (i=0; i < n; ++i)
+      if (lengths[i])
+         codes[i] = (unsigned short) stbiw__zlib_bitrev(next[lengths[i]]++, lengths[i]);
+}
+
+// Raw deflate of data[begin,end) for filtered black and white scanlines. The
+// only matches tried are a run of the previous byte (distance 1) and the
+// same bytes one row up (distance row_len, 0 to disable), so there is no hash
+// table to build or walk. Each chunk is a dynamic Huffman block: the
+// literal/length lengths are the fixed table above, and the row distance
+// gets the 1-bit distance code, since its code depends on the image width.
+static unsigned char *stbiw__zlib_deflate_bilevel(unsigned char *data, int begin, int end, int final, int row_len)
+{
+   static unsigned short lengthc[] = { 3,4,5,6,7,8,9,10,11,13,15,17,19,23,27,31,35,43,51,59,67,83,99,115,131,163,195,227,258, 259 };
+   static unsigned char  lengtheb[]= { 0,0,0,0,0,0,0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4,  4,  5,  5,  5,  5,  0 };
+   static unsigned short distc[]   = { 1,2,3,4,5,7,9,13,17,25,33,49,65,97,129,193,257,385,513,769,1025,1537,2049,3073,4097,6145,8193,12289,16385,24577, 32768 };
+   static unsigned char  disteb[]  = { 0,0,0,0,1,1,2,2,3,3,4,4,5,5,6,6,7,7,8,8,9,9,10,10,11,11,12,12,13,13 };
+   static unsigned char  clorder[] = { 16,17,18,0,8,7,9,6,10,5,11,4,12,3,13,2,14,1,15 };
+   unsigned short litcode[286], distcode[30];
+   unsigned char distlen[30];
+   unsigned int bitbuf=0;
+   int i,j, bitcount=0, row_dist_code, row_extra=0, other=0;
+   unsigned char *out = NULL;
+
+   if (row_len < 2 || row_len > 32768) row_len = 0;
+   row_dist_code = 29;
+   if (row_len) {
+      for (row_dist_code=0; row_len > distc[row_dist_code+1]-1; ++row_dist_code);
+      row_extra = row_len - distc[row_dist_code];
+   }
+   // distance 1 gets 2 bits, the row distance 1 bit, and the other 28 codes
+   // share the last quarter: 4 of 6 bits and 24 of 7 bits
+   for (i=0; i < 30; ++i) {
+      if (i == row_dist_code) distlen[i] = 1;
+      else if (i == 0) distlen[i] = 2;
+      else distlen[i] = (unsigned char) (other++ < 4 ? 6 : 7);
+   }
+   stbiw__zlib_canonical(stbiw__bilevel_litlen, 286, litcode);
+   stbiw__zlib_canonical(distlen, 30, distcode);
+
+   stbiw__zlib_add(final,1);  // BFINAL
+   stbiw__zlib_add(2,2);  // BTYPE = 2 -- dynamic huffman
+   stbiw__zlib_add(286-257,5);  // HLIT
+   stbiw__zlib_add(30-1,5);     // HDIST
+   stbiw__zlib_add(19-4,4);     // HCLEN
+   // code length code: lengths 0..15 all get 4 bits, 16..18 are unused
+   for (i=0; i < 19; ++i)
+      stbiw__zlib_add(clorder[i] < 16 ? 4 : 0, 3);
+   for (i=0; i < 286; ++i)
+      stbiw__zlib_huffa(stbiw__bilevel_litlen[i], 4);
+   for (i=0; i < 30; ++i)
+      stbiw__zlib_huffa(distlen[i], 4);
+
+   i=begin;
+   while (i < end) {
+      int best = 0, d = 0;
+      if (i >= 1) {
+         best = stbiw__zlib_countm(data+i-1, data+i, end-i);
+         d = 1;
+      }
+      if (row_len && i >= row_len) {
+         int e = stbiw__zlib_countm(data+i-row_len, data+i, end-i);
+         if (e > best) { best = e; d = row_len; }
+      }
+      if (best >= 3) {
+         for (j=0; best > lengthc[j+1]-1; ++j);
+         stbiw__zlib_add(litcode[j+257], stbiw__bilevel_litlen[j+257]);
+         if (lengtheb[j]) stbiw__zlib_add(best - lengthc[j], lengtheb[j]);
+         if (d == 1) {
+            stbiw__zlib_add(distcode[0], distlen[0]);
+         } else {
+            stbiw__zlib_add(distcode[row_dist_code], 1);
+            if (disteb[row_dist_code]) stbiw__zlib_add(row_extra, disteb[row_dist_code]);
+         }
+         i += best;
+      } else {
+         stbiw__zlib_add(litcode[data[i]], stbiw__bilevel_litlen[data[i]]);
+         ++i;
+      }
+   }
+   stbiw__zlib_add(litcode[256], stbiw__bilevel_litlen[256]); // end of block
+
+   return stbiw__zlib_end_chunk(out, bitbuf, bitcount, final);
+}
+
+static unsigned int stbiw__adler32(unsigned char *data, int data_len)
+{
+#ifdef STBIW_ADLER32
+   return STBIW_ADLER32(data, data_len);
+#else
+   unsigned int s1=1, s2=0;
+   int i, j=0, blocklen = (int) (data_len % 5552);
+   while (j < data_len) {
+      for (i=0; i < blocklen; ++i) { s1 += data[j+i]; s2 += s1; }
+      s1 %= 65521; s2 %= 65521;
+      j += blocklen;
+      blocklen = 5552;
+   }
+   return (s2 << 16) | s1;
+#endif
+}
+
+// adler32 of A followed by B, from the adler32 of each and the length of B
+static unsigned int stbiw__adler32_combine(unsigned int adler1, unsigned int adler2, int len2)
+{
+   unsigned int rem = (unsigned int) len2 % 65521;
+   unsigned int s1 = adler1 & 0xffff;
+   unsigned int s2 = rem * s1 % 65521;
+   s1 += (adler2 & 0xffff) + 65521 - 1;
+   s2 += (adler1 >> 16) + (adler2 >> 16) + 65521 - rem;
+   if (s1 >= 65521) s1 -= 65521;
+   if (s1 >= 65521) s1 -= 65521;
+   if (s2 >= 65521*2) s2 -= 65521*2;
+   if (s2 >= 65521) s2 -= 65521;
+   return (s2 << 16) | s1;
+}
+
+// appends the adler32 trailer (falling back to stored blocks if the compressed
+// stream came out bigger) and returns a freeable pointer
+static unsigned char *stbiw__zlib_finish(unsigned char *out, unsigned char *data, int data_len, unsigned int adler, int *out_len)
+{
+   int j;
+
    // store uncompressed instead if compression was worse
-   if (stbiw__sbn(out) > data_len + 2 + ((data_len+32766)/32767)*5) {
+   if (data_len > 0 && stbiw__sbn(out) > data_len + 2 + ((data_len+32766)/32767)*5) {
       stbiw__sbn(out) = 2;  // truncate to DEFLATE 32K window and FLEVEL = 1
       for (j = 0; j < data_len;) {
          int blocklen = data_len - j;
@@ -998,29 +1352,110 @@ STBIWDEF unsigned char * stbi_zlib_compress(unsigned char *data, int data_len, i
       }
    }
 
-   {
-      // compute adler32 on input
-      unsigned int s1=1, s2=0;
-      int blocklen = (int) (data_len % 5552);
-      j=0;
-      while (j < data_len) {
-         for (i=0; i < blocklen; ++i) { s1 += data[j+i]; s2 += s1; }
-         s1 %= 65521; s2 %= 65521;
-         j += blocklen;
-         blocklen = 5552;
-      }
-      stbiw__sbpush(out, STBIW_UCHAR(s2 >> 8));
-      stbiw__sbpush(out, STBIW_UCHAR(s2));
-      stbiw__sbpush(out, STBIW_UCHAR(s1 >> 8));
-      stbiw__sbpush(out, STBIW_UCHAR(s1));
-   }
+   stbiw__sbpush(out, STBIW_UCHAR(adler >> 24));
+   stbiw__sbpush(out, STBIW_UCHAR(adler >> 16));
+   stbiw__sbpush(out, STBIW_UCHAR(adler >> 8));
+   stbiw__sbpush(out, STBIW_UCHAR(adler));
    *out_len = stbiw__sbn(out);
    // make returned pointer freeable
    STBIW_MEMMOVE(stbiw__sbraw(out), out, *out_len);
    return (unsigned char *) stbiw__sbraw(out);
+}
+
+typedef struct
+{
+   unsigned char *data;
+   int data_len, row_len, quality;
+   unsigned char **chunks;
+   unsigned int *adler;
+} stbiw__zlib_job;
+
+static void stbiw__zlib_task(void *context, int i)
+{
+   stbiw__zlib_job *job = (stbiw__zlib_job *) context;
+   int begin = i * stbiw__ZCHUNK;
+   int end = job->data_len - begin > stbiw__ZCHUNK ? begin + stbiw__ZCHUNK : job->data_len;
+   int final = end == job->data_len;
+   if (job->quality == STBIW_ZLIB_BILEVEL)
+      job->chunks[i] = stbiw__zlib_deflate_bilevel(job->data, begin, end, final, job->row_len);
+   else if (job->quality < 5)
+      job->chunks[i] = stbiw__zlib_deflate_fast(job->data, begin, end, final, job->quality);
+   else
+      job->chunks[i] = stbiw__zlib_deflate_chunk(job->data, begin, end, final, job->quality);
+   job->adler[i] = stbiw__adler32(job->data + begin, end - begin);
+}
+
+// Compresses data in stbiw__ZCHUNK pieces, one task each, and joins them
+// into a single zlib stream. The output does not depend on how the tasks
+// are scheduled.
+static unsigned char *stbiw__zlib_compress_chunks(unsigned char *data, int data_len, int row_len, int *out_len, int quality)
+{
+   stbiw__zlib_job job;
+   int i, n = data_len > 0 ? (data_len + stbiw__ZCHUNK - 1) / stbiw__ZCHUNK : 1, failed = 0;
+   unsigned int adler;
+   unsigned char *out = NULL;
+
+   job.data = data;
+   job.data_len = data_len;
+   job.row_len = row_len;
+   job.quality = quality;
+   job.chunks = (unsigned char **) STBIW_MALLOC(n * (sizeof(unsigned char *) + sizeof(unsigned int)));
+   if (job.chunks == NULL)
+      return NULL;
+   job.adler = (unsigned int *) (job.chunks + n);
+
+   STBIW_PARALLEL_FOR(n, stbiw__zlib_task, &job);
+
+   stbiw__sbpush(out, 0x78);   // DEFLATE 32K window
+   stbiw__sbpush(out, quality == STBIW_ZLIB_BILEVEL ? 0x01 : 0x5e);   // FLEVEL = 0 or 1
+   adler = 1;
+   for (i=0; i < n; ++i) {
+      int begin = i * stbiw__ZCHUNK;
+      int len = data_len - begin > stbiw__ZCHUNK ? stbiw__ZCHUNK : data_len - begin;
+      if (job.chunks[i] == NULL) {
+         failed = 1;
+         continue;
+      }
+      if (!failed) {
+         int m = stbiw__sbn(job.chunks[i]);
+         stbiw__sbmaybegrow(out, m);
+         memcpy(out + stbiw__sbn(out), job.chunks[i], m);
+         stbiw__sbn(out) += m;
+         adler = stbiw__adler32_combine(adler, job.adler[i], len);
+      }
+      (void) stbiw__sbfree(job.chunks[i]);
+   }
+   STBIW_FREE(job.chunks);
+   if (failed) {
+      (void) stbiw__sbfree(out);
+      return NULL;
+   }
+
+   return stbiw__zlib_finish(out, data, data_len, adler, out_len);
+}
+
+#endif // STBIW_ZLIB_COMPRESS
+
+STBIWDEF unsigned char * stbi_zlib_compress(unsigned char *data, int data_len, int *out_len, int quality)
+{
+#ifdef STBIW_ZLIB_COMPRESS
+   // user provided a zlib compress implementation, use that
+   return STBIW_ZLIB_COMPRESS(data, data_len, out_len, quality);
+#else // use builtin
+   return stbiw__zlib_compress_chunks(data, data_len, 0, out_len, quality);
 #endif // STBIW_ZLIB_COMPRESS
 }
 
+// compresses filtered scanlines of row_len bytes at stbi_write_png_compression_level
+static unsigned char *stbiw__zlib_compress_rows(unsigned char *data, int data_len, int row_len, int *out_len)
+{
+#ifdef STBIW_ZLIB_COMPRESS
+   return stbi_zlib_compress(data, data_len, out_len, stbi_write_png_compression_level);
+#else
+   return stbiw__zlib_compress_chunks(data, data_len, row_len, out_len, stbi_write_png_compression_level);
+#endif
+}
+
 static unsigned int stbiw__crc32(unsigned char *buffer, int len)
 {
 #ifdef STBIW_CRC32
@@ -1074,9 +1509,95 @@ static unsigned int stbiw__crc32(unsigned char *buffer, int len)
 #define stbiw__wp32(data,v) stbiw__wpng4(data, (v)>>24,(v)>>16,(v)>>8,(v));
 #define stbiw__wptag(data,s) stbiw__wpng4(data, s[0],s[1],s[2],s[3])
 
+static unsigned int stbiw__gf2_matrix_times(unsigned int *mat, unsigned int vec)
+{
+   unsigned int sum = 0;
+   while (vec) {
+      if (vec & 1) sum ^= *mat;
+      vec >>= 1;
+      mat++;
+   }
+   return sum;
+}
+
+static void stbiw__gf2_matrix_square(unsigned int *square, unsigned int *mat)
+{
+   int n;
+   for (n = 0; n < 32; n++)
+      square[n] = stbiw__gf2_matrix_times(mat, mat[n]);
+}
+
+// crc32 of A followed by B, from the crc32 of each and the length of B: the
+// crc of A is run through len2 zero bytes by repeated squaring of the
+// one-bit crc step, which takes log2(len2) steps
+static unsigned int stbiw__crc32_combine(unsigned int crc1, unsigned int crc2, int len2)
+{
+   unsigned int even[32], odd[32], row = 1;
+   int n;
+   if (len2 <= 0) return crc1;
+
+   odd[0] = 0xedb88320u;
+   for (n = 1; n < 32; n++) {
+      odd[n] = row;
+      row <<= 1;
+   }
+   stbiw__gf2_matrix_square(even, odd); // 2 zero bits
+   stbiw__gf2_matrix_square(odd, even); // 4 zero bits
+   do {
+      stbiw__gf2_matrix_square(even, odd);
+      if (len2 & 1) crc1 = stbiw__gf2_matrix_times(even, crc1);
+      len2 >>= 1;
+      if (len2 == 0) break;
+      stbiw__gf2_matrix_square(odd, even);
+      if (len2 & 1) crc1 = stbiw__gf2_matrix_times(odd, crc1);
+      len2 >>= 1;
+   } while (len2 != 0);
+   return crc1 ^ crc2;
+}
+
+#define stbiw__CRCCHUNK  (1 << 20)
+
+typedef struct
+{
+   unsigned char *buffer;
+   int len;
+   unsigned int *crc;
+} stbiw__crc_job;
+
+static void stbiw__crc_task(void *context, int i)
+{
+   stbiw__crc_job *job = (stbiw__crc_job *) context;
+   int begin = i * stbiw__CRCCHUNK;
+   int len = job->len - begin > stbiw__CRCCHUNK ? stbiw__CRCCHUNK : job->len - begin;
+   job->crc[i] = stbiw__crc32(job->buffer + begin, len);
+}
+
+// crc32 in stbiw__CRCCHUNK pieces, one task each
+static unsigned int stbiw__crc32_chunks(unsigned char *buffer, int len)
+{
+   stbiw__crc_job job;
+   unsigned int crc;
+   int i, n = (len + stbiw__CRCCHUNK - 1) / stbiw__CRCCHUNK;
+   if (n <= 1)
+      return stbiw__crc32(buffer, len);
+
+   job.buffer = buffer;
+   job.len = len;
+   job.crc = (unsigned int *) STBIW_MALLOC(n * sizeof(unsigned int));
+   if (job.crc == NULL)
+      return stbiw__crc32(buffer, len);
+   STBIW_PARALLEL_FOR(n, stbiw__crc_task, &job);
+
+   crc = job.crc[0];
+   for (i=1; i < n; ++i)
+      crc = stbiw__crc32_combine(crc, job.crc[i], i == n-1 ? len - i*stbiw__CRCCHUNK : stbiw__CRCCHUNK);
+   STBIW_FREE(job.crc);
+   return crc;
+}
+
 static void stbiw__wpcrc(unsigned char **data, int len)
 {
-   unsigned int crc = stbiw__crc32(*data - len - 4, len+4);
+   unsigned int crc = stbiw__crc32_chunks(*data - len - 4, len+4);
    stbiw__wp32(*data, crc);
 }
 
@@ -1088,13 +1609,66 @@ static unsigned char stbiw__paeth(int a, int b, int c)
    return STBIW_UCHAR(c);
 }
 
+#ifdef STBIW_SSE2
+// paeth predictor for 16 bytes at once, in 16-bit lanes
+static __m128i stbiw__paeth_sse2(__m128i a8, __m128i b8, __m128i c8)
+{
+   __m128i zero = _mm_setzero_si128(), r[2];
+   int k;
+   for (k=0; k < 2; ++k) {
+      __m128i a = k ? _mm_unpackhi_epi8(a8, zero) : _mm_unpacklo_epi8(a8, zero);
+      __m128i b = k ? _mm_unpackhi_epi8(b8, zero) : _mm_unpacklo_epi8(b8, zero);
+      __m128i c = k ? _mm_unpackhi_epi8(c8, zero) : _mm_unpacklo_epi8(c8, zero);
+      __m128i bc = _mm_sub_epi16(b, c), ac = _mm_sub_epi16(a, c);
+      __m128i pa = _mm_max_epi16(bc, _mm_sub_epi16(zero, bc)); // |p-a| = |b-c|
+      __m128i pb = _mm_max_epi16(ac, _mm_sub_epi16(zero, ac)); // |p-b| = |a-c|
+      __m128i pc = _mm_add_epi16(bc, ac);
+      __m128i not_a, use_c;
+      pc = _mm_max_epi16(pc, _mm_sub_epi16(zero, pc));         // |p-c| = |a+b-2c|
+      not_a = _mm_or_si128(_mm_cmpgt_epi16(pa, pb), _mm_cmpgt_epi16(pa, pc));
+      use_c = _mm_cmpgt_epi16(pb, pc);
+      b = _mm_or_si128(_mm_andnot_si128(use_c, b), _mm_and_si128(use_c, c));
+      r[k] = _mm_or_si128(_mm_andnot_si128(not_a, a), _mm_and_si128(not_a, b));
+   }
+   return _mm_packus_epi16(r[0], r[1]);
+}
+
+// the body of stbiw__encode_png_line 16 bytes at a time; returns where it stopped
+static int stbiw__encode_png_line_sse2(unsigned char *z, int signed_stride, int len, int n, int type, signed char *line_buffer)
+{
+   __m128i one = _mm_set1_epi8(1), low7 = _mm_set1_epi8(0x7f);
+   int i;
+   for (i = n; i + 16 <= len; i += 16) {
+      __m128i x = _mm_loadu_si128((__m128i *) (z + i));
+      __m128i a = _mm_loadu_si128((__m128i *) (z + i - n));
+      __m128i b, p;
+      switch (type) {
+         case 1: case 6: p = a; break;
+         case 2: p = _mm_loadu_si128((__m128i *) (z + i - signed_stride)); break;
+         case 3: // avg_epu8 rounds up, (a+b)>>1 rounds down
+            b = _mm_loadu_si128((__m128i *) (z + i - signed_stride));
+            p = _mm_sub_epi8(_mm_avg_epu8(a, b), _mm_and_si128(_mm_xor_si128(a, b), one));
+            break;
+         case 4:
+            b = _mm_loadu_si128((__m128i *) (z + i - signed_stride));
+            p = stbiw__paeth_sse2(a, b, _mm_loadu_si128((__m128i *) (z + i - signed_stride - n)));
+            break;
+         case 5: p = _mm_and_si128(_mm_srli_epi16(a, 1), low7); break;
+         default: return i;
+      }
+      _mm_storeu_si128((__m128i *) (line_buffer + i), _mm_sub_epi8(x, p));
+   }
+   return i;
+}
+#endif
+
 // @OPTIMIZE: provide an option that always forces left-predict or paeth predict
 static void stbiw__encode_png_line(unsigned char *pixels, int stride_bytes, int width, int height, int y, int n, int filter_type, signed char *line_buffer)
 {
    static int mapping[] = { 0,1,2,3,4 };
    static int firstmap[] = { 0,1,0,5,6 };
    int *mymap = (y != 0) ? mapping : firstmap;
-   int i;
+   int i, start = n;
    int type = mymap[filter_type];
    unsigned char *z = pixels + stride_bytes * (stbi__flip_vertically_on_write ? height-1-y : y);
    int signed_stride = stbi__flip_vertically_on_write ? -stride_bytes : stride_bytes;
@@ -1115,71 +1689,107 @@ static void stbiw__encode_png_line(unsigned char *pixels, int stride_bytes, int
          case 6: line_buffer[i] = z[i]; break;
       }
    }
+#ifdef STBIW_SSE2
+   start = stbiw__encode_png_line_sse2(z, signed_stride, width*n, n, type, line_buffer);
+#endif
    switch (type) {
-      case 1: for (i=n; i < width*n; ++i) line_buffer[i] = z[i] - z[i-n]; break;
-      case 2: for (i=n; i < width*n; ++i) line_buffer[i] = z[i] - z[i-signed_stride]; break;
-      case 3: for (i=n; i < width*n; ++i) line_buffer[i] = z[i] - ((z[i-n] + z[i-signed_stride])>>1); break;
-      case 4: for (i=n; i < width*n; ++i) line_buffer[i] = z[i] - stbiw__paeth(z[i-n], z[i-signed_stride], z[i-signed_stride-n]); break;
-      case 5: for (i=n; i < width*n; ++i) line_buffer[i] = z[i] - (z[i-n]>>1); break;
-      case 6: for (i=n; i < width*n; ++i) line_buffer[i] = z[i] - stbiw__paeth(z[i-n], 0,0); break;
+      case 1: for (i=start; i < width*n; ++i) line_buffer[i] = z[i] - z[i-n]; break;
+      case 2: for (i=start; i < width*n; ++i) line_buffer[i] = z[i] - z[i-signed_stride]; break;
+      case 3: for (i=start; i < width*n; ++i) line_buffer[i] = z[i] - ((z[i-n] + z[i-signed_stride])>>1); break;
+      case 4: for (i=start; i < width*n; ++i) line_buffer[i] = z[i] - stbiw__paeth(z[i-n], z[i-signed_stride], z[i-signed_stride-n]); break;
+      case 5: for (i=start; i < width*n; ++i) line_buffer[i] = z[i] - (z[i-n]>>1); break;
+      case 6: for (i=start; i < width*n; ++i) line_buffer[i] = z[i] - stbiw__paeth(z[i-n], 0,0); break;
    }
 }
 
-STBIWDEF unsigned char *stbi_write_png_to_mem(const unsigned char *pixels, int stride_bytes, int x, int y, int n, int *out_len)
+// Estimate the entropy of a filtered line: the sum of |byte| as signed bytes; the less, the better.
+static int stbiw__line_cost(signed char *line, int len)
 {
-   int force_filter = stbi_write_force_png_filter;
-   int ctype[5] = { -1, 0, 4, 2, 6 };
-   unsigned char sig[8] = { 137,80,78,71,13,10,26,10 };
-   unsigned char *out,*o, *filt, *zlib;
-   signed char *line_buffer;
-   int j,zlen;
-
-   if (stride_bytes == 0)
-      stride_bytes = x * n;
+   int i = 0, est = 0;
+#ifdef STBIW_SSE2
+   // min(x, -x) as unsigned bytes is |x| as a signed byte, and sad sums it
+   __m128i zero = _mm_setzero_si128(), sum = zero;
+   for (; i + 16 <= len; i += 16) {
+      __m128i x = _mm_loadu_si128((__m128i *) (line + i));
+      sum = _mm_add_epi64(sum, _mm_sad_epu8(_mm_min_epu8(x, _mm_sub_epi8(zero, x)), zero));
+   }
+   est = _mm_cvtsi128_si32(sum) + _mm_cvtsi128_si32(_mm_unpackhi_epi64(sum, sum));
+#endif
+   for (; i < len; ++i)
+      est += abs(line[i]);
+   return est;
+}
 
-   if (force_filter >= 5) {
-      force_filter = -1;
+// whether a line holds only 0x00 and 0xff, as in a black and white image
+static int stbiw__line_is_bilevel(unsigned char *z, int len)
+{
+   int i = 0;
+#ifdef STBIW_SSE2
+   __m128i zero = _mm_setzero_si128(), ones = _mm_cmpeq_epi8(zero, zero);
+   for (; i + 16 <= len; i += 16) {
+      __m128i x = _mm_loadu_si128((__m128i *) (z + i));
+      if (_mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(x, zero), _mm_cmpeq_epi8(x, ones))) != 0xffff)
+         return 0;
    }
+#endif
+   for (; i < len; ++i)
+      if (z[i] != 0 && z[i] != 0xff)
+         return 0;
+   return 1;
+}
 
-   filt = (unsigned char *) STBIW_MALLOC((x*n+1) * y); if (!filt) return 0;
-   line_buffer = (signed char *) STBIW_MALLOC(x * n); if (!line_buffer) { STBIW_FREE(filt); return 0; }
-   for (j=0; j < y; ++j) {
+// rows filtered per task
+#define stbiw__FILTER_BYTES  (1 << 18)
+
+typedef struct
+{
+   unsigned char *pixels;
+   int stride_bytes, x, y, n, force_filter, rows;
+   unsigned char *filt;
+   signed char *line_buffers;
+} stbiw__filter_job;
+
+static void stbiw__filter_task(void *context, int t)
+{
+   stbiw__filter_job *job = (stbiw__filter_job *) context;
+   int x = job->x, y = job->y, n = job->n;
+   signed char *line_buffer = job->line_buffers + (size_t) t * x * n;
+   int j, end = (t+1) * job->rows < y ? (t+1) * job->rows : y;
+   for (j = t * job->rows; j < end; ++j) {
+      signed char *row = (signed char *) job->filt + (size_t) j*(x*n+1) + 1;
       int filter_type;
-      if (force_filter > -1) {
-         filter_type = force_filter;
-         stbiw__encode_png_line((unsigned char*)(pixels), stride_bytes, x, y, j, n, force_filter, line_buffer);
+      if (job->force_filter > -1) {
+         filter_type = job->force_filter;
       } else { // Estimate the best filter by running through all of them:
-         int best_filter = 0, best_filter_val = 0x7fffffff, est, i;
-         for (filter_type = 0; filter_type < 5; filter_type++) {
-            stbiw__encode_png_line((unsigned char*)(pixels), stride_bytes, x, y, j, n, filter_type, line_buffer);
-
-            // Estimate the entropy of the line using this filter; the less, the better.
-            est = 0;
-            for (i = 0; i < x*n; ++i) {
-               est += abs((signed char) line_buffer[i]);
-            }
+         int best_filter = 0, best_filter_val = 0x7fffffff, est;
+         // in black and white images Up or None all but always wins
+         int step = stbiw__line_is_bilevel(job->pixels + (size_t) job->stride_bytes * (stbi__flip_vertically_on_write ? y-1-j : j), x*n) ? 2 : 1;
+         for (filter_type = 0; filter_type < (step == 2 ? 3 : 5); filter_type += step) {
+            stbiw__encode_png_line(job->pixels, job->stride_bytes, x, y, j, n, filter_type, line_buffer);
+            est = stbiw__line_cost(line_buffer, x*n);
             if (est < best_filter_val) {
                best_filter_val = est;
                best_filter = filter_type;
             }
          }
-         if (filter_type != best_filter) {  // If the last iteration already got us the best filter, don't redo it
-            stbiw__encode_png_line((unsigned char*)(pixels), stride_bytes, x, y, j, n, best_filter, line_buffer);
-            filter_type = best_filter;
-         }
+         filter_type = best_filter;
       }
-      // when we get here, filter_type contains the filter type, and line_buffer contains the data
-      filt[j*(x*n+1)] = (unsigned char) filter_type;
-      STBIW_MEMMOVE(filt+j*(x*n+1)+1, line_buffer, x*n);
+      // filter straight into place
+      stbiw__encode_png_line(job->pixels, job->stride_bytes, x, y, j, n, filter_type, row);
+      row[-1] = (signed char) filter_type;
    }
-   STBIW_FREE(line_buffer);
-   zlib = stbi_zlib_compress(filt, y*( x*n+1), &zlen, stbi_write_png_compression_level);
-   STBIW_FREE(filt);
-   if (!zlib) return 0;
+}
+
+
+// wraps a compressed IDAT stream in the signature, IHDR and IEND; takes ownership of zlib
+static unsigned char *stbiw__write_png_chunks(unsigned char *zlib, int zlen, int x, int y, int depth, int ctype, int *out_len)
+{
+   unsigned char sig[8] = { 137,80,78,71,13,10,26,10 };
+   unsigned char *out,*o;
 
    // each tag requires 12 bytes of overhead
    out = (unsigned char *) STBIW_MALLOC(8 + 12+13 + 12+zlen + 12);
-   if (!out) return 0;
+   if (!out) { STBIW_FREE(zlib); return 0; }
    *out_len = 8 + 12+13 + 12+zlen + 12;
 
    o=out;
@@ -1188,8 +1798,8 @@ STBIWDEF unsigned char *stbi_write_png_to_mem(const unsigned char *pixels, int s
    stbiw__wptag(o, "IHDR");
    stbiw__wp32(o, x);
    stbiw__wp32(o, y);
-   *o++ = 8;
-   *o++ = STBIW_UCHAR(ctype[n]);
+   *o++ = STBIW_UCHAR(depth);
+   *o++ = STBIW_UCHAR(ctype);
    *o++ = 0;
    *o++ = 0;
    *o++ = 0;
@@ -1211,6 +1821,104 @@ STBIWDEF unsigned char *stbi_write_png_to_mem(const unsigned char *pixels, int s
    return out;
 }
 
+STBIWDEF unsigned char *stbi_write_png_to_mem(const unsigned char *pixels, int stride_bytes, int x, int y, int n, int *out_len)
+{
+   int force_filter = stbi_write_force_png_filter;
+   int ctype[5] = { -1, 0, 4, 2, 6 };
+   unsigned char *filt, *zlib;
+   stbiw__filter_job job;
+   int tasks,zlen;
+
+   // an empty image has no rows to split into filter jobs (and PNG forbids it)
+   if (y <= 0 || x <= 0)
+      return 0;
+
+   if (stride_bytes == 0)
+      stride_bytes = x * n;
+
+   if (force_filter >= 5) {
+      force_filter = -1;
+   }
+
+   // rows are filtered independently, in tasks of about stbiw__FILTER_BYTES
+   job.rows = stbiw__FILTER_BYTES / (x*n) + 1;
+   tasks = (y + job.rows - 1) / job.rows;
+   filt = (unsigned char *) STBIW_MALLOC((x*n+1) * y); if (!filt) return 0;
+   job.line_buffers = (signed char *) STBIW_MALLOC((size_t) tasks * x * n); if (!job.line_buffers) { STBIW_FREE(filt); return 0; }
+   job.pixels = (unsigned char *) pixels;
+   job.stride_bytes = stride_bytes;
+   job.x = x;
+   job.y = y;
+   job.n = n;
+   job.force_filter = force_filter;
+   job.filt = filt;
+   STBIW_PARALLEL_FOR(tasks, stbiw__filter_task, &job);
+   STBIW_FREE(job.line_buffers);
+   zlib = stbiw__zlib_compress_rows(filt, y*( x*n+1), x*n+1, &zlen);
+   STBIW_FREE(filt);
+   if (!zlib) return 0;
+
+   return stbiw__write_png_chunks(zlib, zlen, x, y, 8, ctype[n], out_len);
+}
+
+STBIWDEF unsigned char *stbi_write_png_1bit_to_mem(const unsigned char *bits, int stride_bytes, int x, int y, int *out_len)
+{
+   int force_filter = stbi_write_force_png_filter;
+   int row_bytes = (x + 7) >> 3;
+   int signed_stride;
+   unsigned char *filt, *zlib;
+   signed char *line_buffer;
+   int i,j,zlen;
+
+   if (y <= 0 || x <= 0)
+      return 0;
+
+   if (stride_bytes == 0)
+      stride_bytes = row_bytes;
+   signed_stride = stbi__flip_vertically_on_write ? -stride_bytes : stride_bytes;
+
+   if (force_filter >= 5) {
+      force_filter = -1;
+   }
+
+   filt = (unsigned char *) STBIW_MALLOC((row_bytes+1) * y); if (!filt) return 0;
+   line_buffer = (signed char *) STBIW_MALLOC(row_bytes); if (!line_buffer) { STBIW_FREE(filt); return 0; }
+   for (j=0; j < y; ++j) {
+      const unsigned char *z = bits + stride_bytes * (stbi__flip_vertically_on_write ? y-1-j : j);
+      unsigned char *row = filt+j*(row_bytes+1);
+      int filter_type = 0;
+      if (force_filter > -1) {
+         // packed pixels are one byte per "pixel" as far as the filters are concerned
+         stbiw__encode_png_line((unsigned char*)(bits), stride_bytes, row_bytes, y, j, 1, force_filter, line_buffer);
+         row[0] = (unsigned char) force_filter;
+         STBIW_MEMMOVE(row+1, line_buffer, row_bytes);
+         continue;
+      }
+      if (j != 0) {
+         // Bilevel rows are mostly runs, so the filter that leaves the most zero
+         // bytes is the one that compresses best.
+         int none = 0, up = 0;
+         for (i = 0; i < row_bytes; ++i) {
+            none += z[i] != 0;
+            up += z[i] != z[i-signed_stride];
+         }
+         if (up < none) filter_type = 2;
+      }
+      row[0] = (unsigned char) filter_type;
+      if (filter_type == 2) {
+         for (i = 0; i < row_bytes; ++i) row[i+1] = STBIW_UCHAR(z[i] - z[i-signed_stride]);
+      } else {
+         memcpy(row+1, z, row_bytes);
+      }
+   }
+   STBIW_FREE(line_buffer);
+   zlib = stbiw__zlib_compress_rows(filt, y*(row_bytes+1), row_bytes+1, &zlen);
+   STBIW_FREE(filt);
+   if (!zlib) return 0;
+
+   return stbiw__write_png_chunks(zlib, zlen, x, y, 1, 0, out_len);
+}
+
 #ifndef STBI_WRITE_NO_STDIO
 STBIWDEF int stbi_write_png(char const *filename, int x, int y, int comp, const void *data, int stride_bytes)
 {
@@ -1238,6 +1946,33 @@ STBIWDEF int stbi_write_png_to_func(stbi_write_func *func, void *context, int x,
    return 1;
 }
 
+#ifndef STBI_WRITE_NO_STDIO
+STBIWDEF int stbi_write_png_1bit(char const *filename, int x, int y, const void *bits, int stride_bytes)
+{
+   FILE *f;
+   int len;
+   unsigned char *png = stbi_write_png_1bit_to_mem((const unsigned char *) bits, stride_bytes, x, y, &len);
+   if (png == NULL) return 0;
+
+   f = stbiw__fopen(filename, "wb");
+   if (!f) { STBIW_FREE(png); return 0; }
+   fwrite(png, 1, len, f);
+   fclose(f);
+   STBIW_FREE(png);
+   return 1;
+}
+#endif
+
+STBIWDEF int stbi_write_png_1bit_to_func(stbi_write_func *func, void *context, int x, int y, const void *bits, int stride_bytes)
+{
+   int len;
+   unsigned char *png = stbi_write_png_1bit_to_mem((const unsigned char *) bits, stride_bytes, x, y, &len);
+   if (png == NULL) return 0;
+   func(context, png, len);
+   STBIW_FREE(png);
+   return 1;
+}
+
 
 /* ***************************************************************************
  *